@@ -12,6 +12,8 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <assert.h>
+#include <math.h>
+#include <signal.h>
 
 #define WHITE 0
 #define BLACK 8
@@ -28,6 +30,14 @@ typedef enum { CASTLE = 0x40, PROMO = 0x20, EP = 0x10, CAPTURE = 0x08 } TMoveTyp
 /* bitboard types */
 typedef uint64_t TBB;
 
+/* alignment of a structure, ALIGNED(CACHE_LINE) keeps every instance on its own cache lines */
+#define CACHE_LINE 64
+#if defined(_MSC_VER)&&!defined(__clang__)
+#define ALIGNED(n) __declspec(align(n))
+#else
+#define ALIGNED(n) __attribute__((aligned(n)))
+#endif
+
 /* move structure */
 typedef union
 {
@@ -53,8 +63,17 @@ Board structure definition
 PM,P0,P1,P2 are the 4 bitboards that contain the whole board
 PM is the bitboard with the side to move pieces
 P0,P1 and P2: with these bitboards you can obtain every type of pieces and every pieces combinations.
+The board takes 40 bytes, so some boards of the game cross a cache line: with -DALIGNED_BOARD every board has its
+own cache line, but Make copies 64 bytes instead of 40. A 32-byte board with the flags in an array beside the game
+was also slower than the 40 bytes: the flags must be found from the board, and a copy make copies them anyway.
 */
-typedef struct
+#if defined(ALIGNED_BOARD)
+#define BOARD_ALIGNMENT ALIGNED(CACHE_LINE)
+#else
+#define BOARD_ALIGNMENT
+#endif
+
+typedef struct BOARD_ALIGNMENT
 {
     TBB PM;
     TBB P0;
@@ -65,15 +84,90 @@ typedef struct
     uint8_t STM; /* side to move */
 } TBoard;
 
+/* maximum depth of a perft, the move buffers of a search are allocated for every depth */
+#define MAX_DEPTH 64
+
+/*
+Hash table of the subtree counts, every bucket fills a cache line with 4 entries.
+Data contains the count of the subtree in the high 56 bits and the depth in the low 8 bits.
+The table can be shared between threads without locks: Check is the key xored with Data, an entry
+written by two threads at the same time has Check^Data different from both keys, so it's a miss
+and never a wrong count.
+*/
+typedef struct
+{
+    TBB Check;
+    uint64_t Data;
+} THashEntry;
+
+typedef struct
+{
+    THashEntry Entry[4];
+} THashBucket;
+
+typedef struct
+{
+    THashBucket* Buckets; /* allocated with AllocLarge, aligned to the page */
+    uint64_t Mask; /* number of buckets - 1 */
+    const char* Backing; /* pages of the memory, as returned by AllocLarge */
+    void* File; /* mapping of the hash file (header and buckets), NULL if the table is not backed by a file */
+} THashTable;
+
+/*
+Header of a hash file, the buckets follow at HASH_FILE_HEADER bytes from the start. A file is reused only if
+all the fields match this build: the version of the format, the fingerprint of the Zobrist keys and the layout
+of the entries. The entries don't need other checks: one written partially because of a crash has Check^Data
+different from every key, so it's a miss.
+*/
+#define HASH_FILE_MAGIC "QBBHASH"
+#define HASH_FILE_VERSION 1
+#define HASH_FILE_HEADER 4096
+
+typedef struct
+{
+    char Magic[8];
+    uint32_t Version;
+    uint32_t EntrySize; /* sizeof(THashEntry) */
+    uint32_t BucketEntries; /* entries of a bucket */
+    uint32_t DepthBits; /* low bits of Data with the depth, the count is in the others */
+    uint64_t KeyScheme; /* ZobristFingerprint() */
+    uint64_t Buckets; /* number of buckets, a power of two */
+} THashFileHeader;
+
 /*
+Search context: every thread that runs a Perft works on its own context
 Into Game are saved all the positions from the last 50 move counter reset
 Position is the pointer to the last position of the game
+Quiets and Capture are the move buffers, one for every remaining depth
+Hash is the hash table of the subtree counts, NULL if not used
+With UNDO_MAKE the moves are made on Position itself and Undo is the stack of what they can't restore by themselves
+The context is aligned to the cache line, so the game starts on a line and the contexts of the threads don't share
+lines: the ones that are not static must be allocated with AllocAligned.
 */
-TBoard Game[512];
-TBoard* Position;
+#if defined(UNDO_MAKE)
+typedef struct
+{
+    uint8_t CastleFlags;
+    uint8_t EnPassant;
+    uint8_t Captured; /* piece type on the destination square before the move */
+} TUndo;
+#endif
+
+typedef struct
+{
+    TBoard Game[512];
+    TBoard* Position;
+    THashTable* Hash;
+    TMove Quiets[MAX_DEPTH][256];
+    TMoveEval Capture[MAX_DEPTH][64];
+#if defined(UNDO_MAKE)
+    TUndo Undo[512];
+    TUndo* UndoTop;
+#endif
+} ALIGNED(CACHE_LINE) TSearch;
 
 /* array of bitboards that contains all the knight destination for every square */
-const TBB KnightDest[64] = { 0x0000000000020400ULL,0x0000000000050800ULL,0x00000000000a1100ULL,0x0000000000142200ULL,
+static const TBB KnightDest[64] = { 0x0000000000020400ULL,0x0000000000050800ULL,0x00000000000a1100ULL,0x0000000000142200ULL,
                            0x0000000000284400ULL,0x0000000000508800ULL,0x0000000000a01000ULL,0x0000000000402000ULL,
                            0x0000000002040004ULL,0x0000000005080008ULL,0x000000000a110011ULL,0x0000000014220022ULL,
                            0x0000000028440044ULL,0x0000000050880088ULL,0x00000000a0100010ULL,0x0000000040200020ULL,
@@ -90,7 +184,7 @@ const TBB KnightDest[64] = { 0x0000000000020400ULL,0x0000000000050800ULL,0x00000
                            0x0004020000000000ULL,0x0008050000000000ULL,0x00110a0000000000ULL,0x0022140000000000ULL,
                            0x0044280000000000ULL,0x0088500000000000ULL,0x0010a00000000000ULL,0x0020400000000000ULL };
 /* The same for the king */
-const TBB KingDest[64] = { 0x0000000000000302ULL,0x0000000000000705ULL,0x0000000000000e0aULL,0x0000000000001c14ULL,
+static const TBB KingDest[64] = { 0x0000000000000302ULL,0x0000000000000705ULL,0x0000000000000e0aULL,0x0000000000001c14ULL,
                           0x0000000000003828ULL,0x0000000000007050ULL,0x000000000000e0a0ULL,0x000000000000c040ULL,
                           0x0000000000030203ULL,0x0000000000070507ULL,0x00000000000e0a0eULL,0x00000000001c141cULL,
                           0x0000000000382838ULL,0x0000000000705070ULL,0x0000000000e0a0e0ULL,0x0000000000c040c0ULL,
@@ -108,13 +202,13 @@ const TBB KingDest[64] = { 0x0000000000000302ULL,0x0000000000000705ULL,0x0000000
                           0x2838000000000000ULL,0x5070000000000000ULL,0xa0e0000000000000ULL,0x40c0000000000000ULL };
 
 /* masks for finding the pawns that can capture with an enpassant (in move generation) */
-const TBB EnPassant[8] = {
+static const TBB EnPassant[8] = {
 0x0000000200000000ULL,0x0000000500000000ULL,0x0000000A00000000ULL,0x0000001400000000ULL,
 0x0000002800000000ULL,0x0000005000000000ULL,0x000000A000000000ULL,0x0000004000000000ULL
 };
 
 /* masks for finding the pawns that can capture with an enpassant (in make move) */
-const TBB EnPassantM[8] = {
+static const TBB EnPassantM[8] = {
 0x0000000002000000ULL,0x0000000005000000ULL,0x000000000A000000ULL,0x0000000014000000ULL,
 0x0000000028000000ULL,0x0000000050000000ULL,0x00000000A0000000ULL,0x0000000040000000ULL
 };
@@ -172,11 +266,84 @@ unsigned long __inline LSB(unsigned __int64 value)
 /* return the number of bits sets of a bitboard */
 #define PopCount(bb) (__builtin_popcountll(bb))
 #endif
+/* atomic add, returns the previous value */
+#if defined(_MSC_VER)&&!defined(__clang__)
+#define AtomicAdd(ptr,val) (_InterlockedExchangeAdd((volatile long*)(ptr),(val)))
+#define AtomicAdd64(ptr,val) (_InterlockedExchangeAdd64((volatile __int64*)(ptr),(val)))
+#define AtomicLoad(ptr) (*(volatile long*)(ptr))
+#define AtomicLoad64(ptr) (*(volatile __int64*)(ptr))
+#define AtomicStore64(ptr,val) (*(volatile __int64*)(ptr)=(val))
+#else
+#define AtomicAdd(ptr,val) (__atomic_fetch_add((ptr),(val),__ATOMIC_RELAXED))
+#define AtomicAdd64(ptr,val) (__atomic_fetch_add((ptr),(val),__ATOMIC_RELAXED))
+#define AtomicLoad(ptr) (__atomic_load_n((ptr),__ATOMIC_RELAXED))
+#define AtomicLoad64(ptr) (__atomic_load_n((ptr),__ATOMIC_RELAXED))
+#define AtomicStore64(ptr,val) (__atomic_store_n((ptr),(val),__ATOMIC_RELAXED))
+#endif
 /* extract the least significant bit of the bitboard */
 #define ExtractLSB(bb) ((bb)&(-(signed long long)(bb)))
 /* reset the least significant bit of bb */
 #define ClearLSB(bb) ((bb)&((bb)-1ll))
 
+/*
+Instrumented build (-DINSTRUMENT): the cycles (rdtsc) and the calls of the generators, Illegal, Make, ChangeSide
+and CountLegal are counted for every depth of the Perft in counters of the thread, that are added to the totals
+when the thread ends and printed at the exit. Without INSTRUMENT the macros are empty and cost nothing.
+ChangeSide is called by Make, so its cycles are counted also in the ones of Make. Every Make is profiled, also the
+ones of the task expansion, of divide, of the statistics and of the moves of a loaded position (at depth 0, only
+in the totals): the only ChangeSide without a Make is the one of loading a fen with black to move.
+*/
+#if defined(INSTRUMENT)
+
+#if defined(_MSC_VER)&&!defined(__clang__)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#include <x86intrin.h>
+#define THREAD_LOCAL __thread
+#endif
+
+enum { PROFILE_GENERATE_CAPTURE, PROFILE_GENERATE_QUIETS, PROFILE_GENERATE_LEGAL, PROFILE_ILLEGAL, PROFILE_MAKE,
+    PROFILE_CHANGE_SIDE, PROFILE_COUNT_LEGAL, PROFILE_FUNCTIONS };
+
+typedef struct
+{
+    uint64_t Cycles[PROFILE_FUNCTIONS][MAX_DEPTH];
+    uint64_t Calls[PROFILE_FUNCTIONS][MAX_DEPTH];
+} TProfile;
+
+static THREAD_LOCAL TProfile Profile; /* counters of the thread */
+static THREAD_LOCAL int ProfileDepth; /* depth of the Perft that the thread is searching */
+static TProfile ProfileTotal; /* counters of the threads that ended */
+
+/* add the counters of the thread to the totals and clear them */
+static void MergeProfile(void)
+{
+    for (int f = 0; f < PROFILE_FUNCTIONS; f++)
+        for (int d = 0; d < MAX_DEPTH; d++)
+        {
+            AtomicAdd64(&ProfileTotal.Cycles[f][d], Profile.Cycles[f][d]);
+            AtomicAdd64(&ProfileTotal.Calls[f][d], Profile.Calls[f][d]);
+        }
+    memset(&Profile, 0, sizeof(Profile));
+}
+
+#define PROFILE_DEPTH(depth) (ProfileDepth = (depth))
+#define PROFILE_START(var) const uint64_t var = __rdtsc()
+#define PROFILE_STOP(var,function) (Profile.Cycles[function][ProfileDepth] += __rdtsc() - (var), Profile.Calls[function][ProfileDepth]++)
+#define PROFILE_MERGE() MergeProfile()
+
+#else
+
+#define PROFILE_DEPTH(depth)
+#define PROFILE_START(var)
+#define PROFILE_STOP(var,function)
+#define PROFILE_MERGE()
+
+#endif
+
+/* All the following macros work on the board pointed by Position, every function that uses them
+   receives the board as a parameter called Position */
+
 /* Macro to check and reset the castle rights:
    CastleSM: short castling side to move
    CastleLM: long castling side to move
@@ -226,6 +393,7 @@ This needs the inversion of the 4 bitboards, roll the Castle rights and update t
 */
 #define ChangeSide \
 do{ \
+   PROFILE_START(changing);\
    Position->PM^=Occupation; /* update the side to move pieces */\
    Position->PM=RevBB(Position->PM);\
    Position->P0=RevBB(Position->P0);\
@@ -233,10 +401,11 @@ do{ \
    Position->P2=RevBB(Position->P2);/* reverse the board */\
    Position->CastleFlags=(Position->CastleFlags>>4)|(Position->CastleFlags<<4);/* roll the castle rights */\
    Position->STM ^= BLACK; /* change the side to move */\
+   PROFILE_STOP(changing, PROFILE_CHANGE_SIDE);\
 }while(0)
 
 /* return the bitboard with the rook destinations */
-static inline TBB GenRook(uint64_t sq, TBB occupation)
+static inline TBB GenRookScan(uint64_t sq, TBB occupation)
 {
     TBB piece = 1ULL << sq;
     occupation ^= piece; /* remove the selected piece from the occupation */
@@ -251,7 +420,7 @@ static inline TBB GenRook(uint64_t sq, TBB occupation)
 }
 
 /* return the bitboard with the bishops destinations */
-static inline TBB GenBishop(uint64_t sq, TBB occupation)
+static inline TBB GenBishopScan(uint64_t sq, TBB occupation)
 {  /* it's the same as the rook */
     TBB piece = 1ULL << sq;
     occupation ^= piece;
@@ -263,8 +432,247 @@ static inline TBB GenBishop(uint64_t sq, TBB occupation)
         ((0x8102040810204081ULL >> (63 - LSB(piecesle))) & (0x8102040810204081ULL << MSB(piecesri)))) ^ piece;
 }
 
+/*
+Sliding pieces backends, selected at build time:
+- pext: the destinations are read from tables indexed with PEXT by the occupation of the relevant squares
+  of the piece, it's the default with BMI2
+- magic: the same tables indexed with fancy magic bitboards, the occupation of the relevant squares is
+  multiplied by the magic of the square and shifted, build with -DMAGIC_SLIDERS (for cpus without BMI2
+  or with a slow microcoded PEXT)
+- scan: the destinations are computed by the scans, build with -DNO_PEXT on a BMI2 cpu
+*/
+#if defined(MAGIC_SLIDERS)
+#define SLIDERS_NAME "magic"
+#elif defined(__BMI2__) && !defined(NO_PEXT)
+#define PEXT_SLIDERS
+#define SLIDERS_NAME "pext"
+#else
+#define SLIDERS_NAME "scan"
+#endif
+
+#if defined(MAGIC_SLIDERS) || defined(PEXT_SLIDERS)
+
+#if defined(PEXT_SLIDERS)
+
+#include <immintrin.h>
+
+/* index of the destinations for the occupation in the table of the square */
+#define RookSlot(sq,occupation) (_pext_u64((occupation), RookMask[sq]))
+#define BishopSlot(sq,occupation) (_pext_u64((occupation), BishopMask[sq]))
+
+#else
+
+/* magics of every square, the index is made by the highest PopCount(mask) bits of the product */
+static const TBB RookMagic[64] = {
+    0x3080004000802010ULL,0x0c40029005c02004ULL,0x4080100259200080ULL,0x1100042009021000ULL,
+    0x2100030010080004ULL,0x1200860044001810ULL,0x0400080110008402ULL,0x2200008040240102ULL,
+    0x0000800020804004ULL,0x0184804000200480ULL,0x0848801004200080ULL,0x1001001001002008ULL,
+    0x8001000408001100ULL,0x0101000802040100ULL,0x4285001401000200ULL,0x008180010020c080ULL,
+    0x0000228000400080ULL,0x0810004000402000ULL,0x0010008020008018ULL,0x1400090021021000ULL,
+    0x820a808004000802ULL,0x0404008002008004ULL,0x0202008080020100ULL,0x094402000c025181ULL,
+    0x0280400080008020ULL,0x0200200040401000ULL,0x0404482200108200ULL,0x00081022000a0040ULL,
+    0x1000040080800800ULL,0x0182000200058810ULL,0x0000827400481021ULL,0x0000008200091064ULL,
+    0x0040004020800089ULL,0x648e024102002082ULL,0x0000200080801000ULL,0x001200419200200aULL,
+    0x0430080080800400ULL,0x0000040080800200ULL,0x002201100400d802ULL,0x5800404082000401ULL,
+    0x0000400080008020ULL,0x0140028020018044ULL,0x4004801204420020ULL,0x080210030021000aULL,
+    0x2204000408008080ULL,0x020a000804020010ULL,0x0100010002008080ULL,0x2000440040820001ULL,
+    0x0000408000210100ULL,0x4000810028420200ULL,0x0a8020010043b100ULL,0x0100201000090100ULL,
+    0x0001021048004500ULL,0x0002020080040080ULL,0x0048080102100400ULL,0x00410000a2084100ULL,
+    0x0040110222004682ULL,0x0802002100408012ULL,0x0420040820401101ULL,0x8040200805001001ULL,
+    0x0045000218001035ULL,0x840a001001080482ULL,0x0800420081300804ULL,0x0400008100402412ULL };
+
+static const TBB BishopMagic[64] = {
+    0x0002200800808083ULL,0x082401020e120004ULL,0x001000a208400000ULL,0x4024052600949040ULL,
+    0x0002021100000101ULL,0x00220802080c0000ULL,0x000c014108210908ULL,0x024a049080901001ULL,
+    0x0043c20411020210ULL,0x002020213a248100ULL,0x09224942040d0183ULL,0x01000c4220802000ULL,
+    0x0041820211000400ULL,0x3000320802080800ULL,0x030084010402a000ULL,0x0210004c04040200ULL,
+    0x0010014430220820ULL,0x0002042008010904ULL,0x08a0403008404040ULL,0x0260202202004000ULL,
+    0x2004005211200800ULL,0x08048060c8044000ULL,0x004b003209012040ULL,0x0460802042009004ULL,
+    0x2002080ec0110440ULL,0x0018022004948800ULL,0x0008404008060040ULL,0x1821080001004300ULL,
+    0x0001020044008401ULL,0x4010004040241008ULL,0x0004040000a08404ULL,0x000cb10082004200ULL,
+    0x6001100800112000ULL,0x06181110a4148400ULL,0x0004002480480204ULL,0x1200400808608200ULL,
+    0x00a8020400001010ULL,0xc220040020010090ULL,0x00018a0080440c10ULL,0x8002020040002401ULL,
+    0x180101109030c040ULL,0x8010884108801000ULL,0x0013420050048100ULL,0x010021a018008101ULL,
+    0x8040080904440401ULL,0x1042240804200a00ULL,0x404802e082018400ULL,0x0010008200480089ULL,
+    0x0004008404201228ULL,0x090042280402000aULL,0x0248108888210800ULL,0x0005800e05042404ULL,
+    0x08000808a1010030ULL,0x0208a02202060a10ULL,0x00c0481901461048ULL,0x00221042418104a0ULL,
+    0x88084400808820c2ULL,0x0000408448421040ULL,0x0880200242009038ULL,0x0c41020080208800ULL,
+    0x0000880520a24410ULL,0x00001041c4080a21ULL,0x0000295810108200ULL,0x0011201a00460020ULL };
+
+static uint8_t RookShift[64];
+static uint8_t BishopShift[64];
+
+#define RookSlot(sq,occupation) ((((occupation) & RookMask[sq]) * RookMagic[sq]) >> RookShift[sq])
+#define BishopSlot(sq,occupation) ((((occupation) & BishopMask[sq]) * BishopMagic[sq]) >> BishopShift[sq])
+
+#endif
+
+/* relevant squares of every square, the edges of the board are not needed */
+static TBB RookMask[64];
+static TBB BishopMask[64];
+/* the destinations of every square start at this index of SliderTable, shared by rooks and bishops */
+static uint32_t RookIndex[64];
+static uint32_t BishopIndex[64];
+static TBB SliderTable[102400 + 5248];
+
+static inline TBB GenRook(uint64_t sq, TBB occupation)
+{
+    return SliderTable[RookIndex[sq] + RookSlot(sq, occupation)];
+}
+
+static inline TBB GenBishop(uint64_t sq, TBB occupation)
+{
+    return SliderTable[BishopIndex[sq] + BishopSlot(sq, occupation)];
+}
+
+/* fill the tables with the scans for all the occupations of the relevant squares */
+static void InitSliders(void)
+{
+    uint32_t index = 0;
+    for (uint64_t sq = 0; sq < 64; sq++)
+    {
+        const TBB piece = 1ULL << sq;
+        const TBB row = 0x00000000000000FFULL << (sq & 0x38);
+        const TBB column = 0x0101010101010101ULL << (sq & 0x07);
+        const TBB rook = GenRookScan(sq, piece);
+        RookMask[sq] = (rook & row & 0x7E7E7E7E7E7E7E7EULL) | (rook & column & 0x00FFFFFFFFFFFF00ULL);
+        BishopMask[sq] = GenBishopScan(sq, piece) & 0x007E7E7E7E7E7E00ULL;
+#if defined(MAGIC_SLIDERS)
+        RookShift[sq] = 64 - PopCount(RookMask[sq]);
+        BishopShift[sq] = 64 - PopCount(BishopMask[sq]);
+#endif
+        RookIndex[sq] = index;
+        TBB occupation = 0;
+        do { /* enumerate all the subsets of the mask, two occupations can share a slot only with the same destinations */
+            TBB* const slot = &SliderTable[index + RookSlot(sq, occupation)];
+            assert(!*slot || *slot == GenRookScan(sq, occupation | piece));
+            *slot = GenRookScan(sq, occupation | piece);
+            occupation = (occupation - RookMask[sq]) & RookMask[sq];
+        } while (occupation);
+        index += 1U << PopCount(RookMask[sq]);
+        BishopIndex[sq] = index;
+        do {
+            TBB* const slot = &SliderTable[index + BishopSlot(sq, occupation)];
+            assert(!*slot || *slot == GenBishopScan(sq, occupation | piece));
+            *slot = GenBishopScan(sq, occupation | piece);
+            occupation = (occupation - BishopMask[sq]) & BishopMask[sq];
+        } while (occupation);
+        index += 1U << PopCount(BishopMask[sq]);
+    }
+    assert(index == (sizeof SliderTable) / (sizeof(SliderTable[0])));
+}
+
+#else
+
+static inline TBB GenRook(uint64_t sq, TBB occupation)
+{
+    return GenRookScan(sq, occupation);
+}
+
+static inline TBB GenBishop(uint64_t sq, TBB occupation)
+{
+    return GenBishopScan(sq, occupation);
+}
+
+static void InitSliders(void)
+{
+}
+
+#endif
+
+/*
+AVX2 Kogge-Stone fills: the attacks of all the sliders of a side are computed at once, every lane of a
+vector fills one direction. The orthogonal vector has the directions up, right, down, left, the diagonal
+vector up-right, up-left, down-right, down-left.
+A square attacked in one direction is reached by a single slider, so a popcount of every lane counts the
+moves of all the sliders. It's used for the last ply and for the attacks of the opponent,
+build with -DKOGGE_STONE on a cpu with AVX2.
+*/
+#if defined(KOGGE_STONE) && defined(__AVX2__)
+
+#include <immintrin.h>
+
+#define KOGGE_STONE_LANES
+
+#define KOGGE_STONE_NAME ", avx2 kogge-stone attacks"
+
+/* shift every lane of the distance of its direction times step, a shift of 64 or more gives 0 so every lane
+   has a left shift and a right shift and one of them is 64 */
+static inline __m256i ShiftLanes(__m256i bb, __m256i left, __m256i right)
+{
+    return _mm256_or_si256(_mm256_sllv_epi64(bb, left), _mm256_srlv_epi64(bb, right));
+}
+
+/* attacks in the directions of the lanes from the squares of gen, mask removes the wrap around the board */
+static inline __m256i FillLanes(__m256i gen, __m256i empty, __m256i mask, __m256i left, __m256i right)
+{
+    __m256i pro = _mm256_and_si256(empty, mask);
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, ShiftLanes(gen, left, right)));
+    pro = _mm256_and_si256(pro, ShiftLanes(pro, left, right));
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, ShiftLanes(gen, _mm256_slli_epi64(left, 1), _mm256_slli_epi64(right, 1))));
+    pro = _mm256_and_si256(pro, ShiftLanes(pro, _mm256_slli_epi64(left, 1), _mm256_slli_epi64(right, 1)));
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, ShiftLanes(gen, _mm256_slli_epi64(left, 2), _mm256_slli_epi64(right, 2))));
+    return _mm256_and_si256(ShiftLanes(gen, left, right), mask);
+}
+
+/* attacks of the rooks and queens in the 4 orthogonal directions */
+static inline __m256i FillOrthogonal(TBB sliders, TBB occupation)
+{
+    return FillLanes(_mm256_set1_epi64x(sliders), _mm256_set1_epi64x(~occupation),
+        _mm256_setr_epi64x(-1LL, 0xFEFEFEFEFEFEFEFELL, -1LL, 0x7F7F7F7F7F7F7F7FLL),
+        _mm256_setr_epi64x(8, 1, 64, 64), _mm256_setr_epi64x(64, 64, 8, 1));
+}
+
+/* attacks of the bishops and queens in the 4 diagonal directions */
+static inline __m256i FillDiagonal(TBB sliders, TBB occupation)
+{
+    return FillLanes(_mm256_set1_epi64x(sliders), _mm256_set1_epi64x(~occupation),
+        _mm256_setr_epi64x(0xFEFEFEFEFEFEFEFELL, 0x7F7F7F7F7F7F7F7FLL, 0xFEFEFEFEFEFEFEFELL, 0x7F7F7F7F7F7F7F7FLL),
+        _mm256_setr_epi64x(9, 7, 64, 64), _mm256_setr_epi64x(64, 64, 7, 9));
+}
+
+/* union of the 4 lanes */
+static inline TBB OrLanes(__m256i lanes)
+{
+    const __m128i half = _mm_or_si128(_mm256_castsi256_si128(lanes), _mm256_extracti128_si256(lanes, 1));
+    return (TBB)_mm_cvtsi128_si64(_mm_or_si128(half, _mm_unpackhi_epi64(half, half)));
+}
+
+/* sum of the popcounts of the 4 lanes masked by target */
+static inline int64_t CountLanes(__m256i lanes, TBB target)
+{
+    uint64_t bb[4];
+    _mm256_storeu_si256((__m256i*)bb, _mm256_and_si256(lanes, _mm256_set1_epi64x(target)));
+    return PopCount(bb[0]) + PopCount(bb[1]) + PopCount(bb[2]) + PopCount(bb[3]);
+}
+
+#else
+
+#define KOGGE_STONE_NAME ""
+
+#endif
+
+/* squares between two squares on the same row, column or diagonal, 0 if they are not aligned */
+static TBB Between[64][64];
+
+/* compute the tables that are not constant, it must be called before any other function */
+static void InitTables(void)
+{
+    InitSliders();
+    for (uint64_t a = 0; a < 64; a++)
+    {
+        for (uint64_t b = 0; b < 64; b++)
+        {
+            TBB occupation = (1ULL << a) | (1ULL << b);
+            if (GenRook(a, 1ULL << a) & (1ULL << b)) Between[a][b] = GenRook(a, occupation) & GenRook(b, occupation);
+            else if (GenBishop(a, 1ULL << a) & (1ULL << b)) Between[a][b] = GenBishop(a, occupation) & GenBishop(b, occupation);
+            else Between[a][b] = 0;
+        }
+    }
+}
+
 /* return the bitboard with pieces of the same type */
-static inline TBB BBPieces(TPieceType piece)
+static inline TBB BBPieces(const TBoard* const Position, TPieceType piece)
 {
     switch (piece) // find the bb with the pieces of the same type
     {
@@ -274,6 +682,7 @@ static inline TBB BBPieces(TPieceType piece)
     case ROOK: return Rooks;
     case QUEEN: return Queens;
     case KING: return Kings;
+    default: return 0;
     }
 }
 
@@ -287,12 +696,13 @@ static inline TBB BBDestinations(TPieceType piece, uint64_t sq, TBB occupation)
     case ROOK: return GenRook(sq, occupation);
     case QUEEN: return GenRook(sq, occupation) | GenBishop(sq, occupation);
     case KING: return KingDest[sq];
+    default: return 0; /* pawns have their own generators */
     }
 }
 
 
 /* try the move and see if the king is in check. If so return the attacking pieces, if not return 0 */
-static inline TBB Illegal(TMove move)
+static inline TBB Illegal(const TBoard* const Position, TMove move)
 {
     TBB From, To;
     From = 1ULL << move.From;
@@ -323,8 +733,9 @@ static inline TBB Illegal(TMove move)
         (KingDest[kingsq] & Kings)) & newopposing);
 }
 
-/* Generate all pseudo-legal quiet moves */
-static inline TMove* GenerateQuiets(TMove* const quiets)
+/* Generate all pseudo-legal quiet moves grouped by kind, ends[] receives the end of the pieces moves,
+   of the pushes, of the double pushes and of the castles, that is also the end returned */
+static inline TMove* GenerateQuiets(const TBoard* const Position, TMove* const quiets, TMove** const ends)
 {
     TBB occupation, opposing;
     occupation = Occupation;
@@ -334,7 +745,7 @@ static inline TMove* GenerateQuiets(TMove* const quiets)
     for (TPieceType piece = KING; piece >= KNIGHT; piece--) // generate moves from king to knight
     {
         // generate moves for every piece of the same type of the side to move
-        for (TBB pieces = BBPieces(piece) & Position->PM; pieces; pieces = ClearLSB(pieces))
+        for (TBB pieces = BBPieces(Position, piece) & Position->PM; pieces; pieces = ClearLSB(pieces))
         {
             uint64_t sq = LSB(pieces);
             // for every destinations on a free square generate a move
@@ -348,6 +759,7 @@ static inline TMove* GenerateQuiets(TMove* const quiets)
             }
         }
     }
+    ends[0] = pquiets;
 
     /* one pawns push */
     TBB push1 = (((Pawns & Position->PM) << 8) & ~occupation) & 0x00FFFFFFFFFFFFFFULL;
@@ -359,6 +771,7 @@ static inline TMove* GenerateQuiets(TMove* const quiets)
         pquiets->Prom = EMPTY;
         pquiets++;
     }
+    ends[1] = pquiets;
 
     /* double pawns pushes */
     for (TBB push2 = (push1 << 8) & ~occupation & 0x00000000FF000000ULL; push2; push2 = ClearLSB(push2))
@@ -369,6 +782,7 @@ static inline TMove* GenerateQuiets(TMove* const quiets)
         pquiets->Prom = EMPTY;
         pquiets++;
     }
+    ends[2] = pquiets;
 
     /* check if long castling is possible */
     if (CastleLM && !(occupation & 0x0EULL))
@@ -418,11 +832,12 @@ static inline TMove* GenerateQuiets(TMove* const quiets)
             pquiets++;
         }
     }
-    return pquiets;
+    return ends[3] = pquiets;
 }
 
-/* Generate all pseudo-legal capture and promotions */
-static inline TMoveEval* GenerateCapture(TMoveEval* const capture)
+/* Generate all pseudo-legal capture and promotions grouped by kind, ends[] receives the end of the captures,
+   of the promotions and of the enpassant captures, that is also the end returned */
+static inline TMoveEval* GenerateCapture(const TBoard* const Position, TMoveEval* const capture, TMoveEval** const ends)
 {
     TBB opposing, occupation;
     occupation = Occupation;
@@ -432,7 +847,7 @@ static inline TMoveEval* GenerateCapture(TMoveEval* const capture)
     for (TPieceType piece = KING; piece >= KNIGHT; piece--) // generate moves from king to knight
     {
         // generate moves for every piece of the same type of the side to move
-        for (TBB pieces = BBPieces(piece) & Position->PM; pieces; pieces = ClearLSB(pieces))
+        for (TBB pieces = BBPieces(Position, piece) & Position->PM; pieces; pieces = ClearLSB(pieces))
         {
             uint64_t sq = LSB(pieces);
             // for every destinations on an opponent pieces generate a move
@@ -470,6 +885,8 @@ static inline TMoveEval* GenerateCapture(TMoveEval* const capture)
         pcapture++;
     }
 
+    ends[0] = pcapture;
+
     /* Generate pawns promotions */
     if (pieces & 0x00FF000000000000ULL)
     {
@@ -532,6 +949,8 @@ static inline TMoveEval* GenerateCapture(TMoveEval* const capture)
         }
     }
 
+    ends[1] = pcapture;
+
     if (Position->EnPassant != 8)
     {  /* Generate EnPassant captures */
         for (TBB enpassant = pieces & EnPassant[Position->EnPassant]; enpassant; enpassant = ClearLSB(enpassant))
@@ -544,291 +963,2517 @@ static inline TMoveEval* GenerateCapture(TMoveEval* const capture)
             pcapture++;
         }
     }
-    return pcapture;
+    return ends[2] = pcapture;
+}
+
+/* return the opponent pieces that give check to the king of the side to move */
+static inline TBB Checkers(const TBoard* const Position)
+{
+    const TBB occupation = Occupation;
+    const TBB king = Kings & Position->PM;
+    const uint64_t kingsq = LSB(king);
+    return ((KnightDest[kingsq] & Knights) |
+        (GenRook(kingsq, occupation) & (Rooks | Queens)) |
+        (GenBishop(kingsq, occupation) & (Bishops | Queens)) |
+        ((((king << 9) & 0xFEFEFEFEFEFEFEFEULL) | ((king << 7) & 0x7F7F7F7F7F7F7F7FULL)) & Pawns)) & (occupation ^ Position->PM);
+}
+
+/* return the squares attacked by the opponent, the sliders see through the king of the side to move
+   that can't step back on their ray */
+static inline TBB Attacked(const TBoard* const Position)
+{
+    const TBB opposing = Position->PM ^ Occupation;
+    const TBB noking = Occupation ^ (Kings & Position->PM);
+    const TBB opppawns = Pawns & opposing;
+    TBB attacked = KingDest[LSB(Kings & opposing)] |
+        ((opppawns >> 7) & 0xFEFEFEFEFEFEFEFEULL) | ((opppawns >> 9) & 0x7F7F7F7F7F7F7F7FULL);
+    for (TBB pieces = Knights & opposing; pieces; pieces = ClearLSB(pieces)) attacked |= KnightDest[LSB(pieces)];
+#if defined(KOGGE_STONE_LANES)
+    attacked |= OrLanes(_mm256_or_si256(FillOrthogonal((Rooks | Queens) & opposing, noking), FillDiagonal((Bishops | Queens) & opposing, noking)));
+#else
+    for (TBB pieces = (Bishops | Queens) & opposing; pieces; pieces = ClearLSB(pieces)) attacked |= GenBishop(LSB(pieces), noking);
+    for (TBB pieces = (Rooks | Queens) & opposing; pieces; pieces = ClearLSB(pieces)) attacked |= GenRook(LSB(pieces), noking);
+#endif
+    return attacked;
 }
 
-/* Make the move */
-static inline void Make(TMove move)
+/*
+Count the legal moves without generating them, it's used for the last ply of the Perft.
+The checkers and the pinned pieces are computed once, the moves of the pieces that are not pinned
+are counted with a popcount of their destinations, promotions count 4 moves.
+The few enpassant captures are tried one by one with Illegal.
+*/
+static inline int64_t CountLegal(const TBoard* const Position)
 {
-    Position++;
-    *Position = *(Position - 1); /* copy the previous position into the last one */
-    TBB part = 1ULL << move.From;
-    TBB dest = 1ULL << move.To;
-    switch (move.MoveType & 0x07)
+    const TBB occupation = Occupation;
+    const TBB own = Position->PM;
+    const TBB opposing = occupation ^ own;
+    const TBB pawns = Pawns;
+    const TBB knights = Knights;
+    const TBB bishopqueens = Bishops | Queens;
+    const TBB rookqueens = Rooks | Queens;
+    const TBB king = Kings & own;
+    const uint64_t kingsq = LSB(king);
+    const TBB checkers = Checkers(Position);
+    const TBB attacked = Attacked(Position);
+
+    int64_t tot = PopCount(KingDest[kingsq] & ~own & ~attacked);
+    if (ClearLSB(checkers)) return tot; /* double check, only the king can move */
+
+    /* destinations allowed to the other pieces: capture or block the checker */
+    TBB target = ~own;
+    if (checkers) target = checkers | Between[kingsq][LSB(checkers)];
+    else
+    {   /* castling, the king is not in check and must not pass on attacked squares */
+        if (CastleSM && !(occupation & 0x60ULL) && !(attacked & 0x60ULL)) tot++;
+        if (CastleLM && !(occupation & 0x0EULL) && !(attacked & 0x0CULL)) tot++;
+    }
+
+    /* pinned pieces: a single own piece between the king and an opponent slider, it can move only on that ray */
+    TBB pinned = 0;
+    for (TBB snipers = ((GenRook(kingsq, opposing | king) & rookqueens) | (GenBishop(kingsq, opposing | king) & bishopqueens)) & opposing;
+        snipers; snipers = ClearLSB(snipers))
     {
-    case PAWN:
-        if (move.MoveType & EP)
-        {  /* EnPassant */
-            Position->PM ^= part | dest;
-            Position->P0 ^= part | dest;
-            Position->P0 ^= dest >> 8; /* delete the captured pawn */
-            Position->EnPassant = 8;
-        }
-        else
+        const uint64_t snipersq = LSB(snipers);
+        const TBB blocker = Between[kingsq][snipersq] & occupation;
+        if (ClearLSB(blocker) || !(blocker & own)) continue;
+        pinned |= blocker;
+        const TBB ray = (Between[kingsq][snipersq] | (1ULL << snipersq)) & target;
+        const uint64_t sq = LSB(blocker);
+        const TPieceType piece = Piece(sq);
+        if (piece == PAWN)
         {
-            if (move.MoveType & CAPTURE)
-            {  /* Delete the captured piece */
-                Position->P0 &= ~dest;
-                Position->P1 &= ~dest;
-                Position->P2 &= ~dest;
-            }
-            if (move.MoveType & PROMO)
-            {
-                Position->PM ^= part | dest;
-                Position->P0 ^= part;
-                Position->P0 |= (TBB)(move.Prom & 1) << (move.To);
-                Position->P1 |= (TBB)(((move.Prom) >> 1) & 1) << (move.To);
-                Position->P2 |= (TBB)((move.Prom) >> 2) << (move.To);
-                Position->EnPassant = 8; /* clear enpassant */
-            }
-            else /* capture or push */
-            {
-                Position->PM ^= part | dest;
-                Position->P0 ^= part | dest;
-                Position->EnPassant = 8; /* clear enpassant */
-                if (move.To == move.From + 16 && EnPassantM[move.To & 0x07] & Pawns & (Position->PM ^ (Occupation)))
-                    Position->EnPassant = move.To & 0x07; /* save enpassant column */
-            }
-            if (move.MoveType & CAPTURE)
-            {
-                if (move.To == 63) ResetCastleSO; /* captured the opponent king side rook */
-                else if (move.To == 56) ResetCastleLO; /* captured the opponent quuen side rook */
-            }
-        }
-        ChangeSide;
-        break;
-    case KNIGHT:
-    case BISHOP:
-    case ROOK:
-    case QUEEN:
-        if (move.MoveType & CAPTURE)
-        {
-            Position->P0 &= ~dest;
-            Position->P1 &= ~dest;
-            Position->P2 &= ~dest;
-        }
-        Position->PM ^= part | dest;
-        Position->P0 ^= (move.MoveType & 1) ? part | dest : 0;
-        Position->P1 ^= (move.MoveType & 2) ? part | dest : 0;
-        Position->P2 ^= (move.MoveType & 4) ? part | dest : 0;
-        Position->EnPassant = 8;
-        if ((move.MoveType & 0x7) == ROOK) /* update the castle rights */
-        {
-            if (move.From == 7) ResetCastleSM;
-            else if (move.From == 0) ResetCastleLM;
-        }
-        if (move.MoveType & CAPTURE) /* update the castle rights */
-        {
-            if (move.To == 63) ResetCastleSO;
-            else if (move.To == 56) ResetCastleLO;
-        }
-        ChangeSide;
-        break;
-    case KING:
-        if (move.MoveType & CAPTURE)
-        {
-            Position->P0 &= ~dest;
-            Position->P1 &= ~dest;
-            Position->P2 &= ~dest;
-        }
-        Position->PM ^= part | dest;
-        Position->P1 ^= part | dest;
-        Position->P2 ^= part | dest;
-        ResetCastleSM; /* update the castle rights */
-        ResetCastleLM;
-        Position->EnPassant = 8;
-        if (move.MoveType & CAPTURE)
-        {
-            if (move.To == 63) ResetCastleSO;
-            else if (move.To == 56) ResetCastleLO;
+            const TBB push1 = (blocker << 8) & ~occupation;
+            const TBB moves = (push1 | ((push1 << 8) & ~occupation & 0x00000000FF000000ULL) |
+                ((((blocker << 9) & 0xFEFEFEFEFEFEFEFEULL) | ((blocker << 7) & 0x7F7F7F7F7F7F7F7FULL)) & opposing)) & ray;
+            tot += PopCount(moves & 0x00FFFFFFFFFFFFFFULL) + 4 * PopCount(moves & 0xFF00000000000000ULL);
         }
-        else if (move.MoveType & CASTLE)
+        else if (piece != KNIGHT) tot += PopCount(BBDestinations(piece, sq, occupation) & ray);
+    }
+
+    /* pieces that are not pinned */
+    for (TBB pieces = knights & own & ~pinned; pieces; pieces = ClearLSB(pieces)) tot += PopCount(KnightDest[LSB(pieces)] & target);
+#if defined(KOGGE_STONE_LANES)
+    tot += CountLanes(FillOrthogonal(rookqueens & own & ~pinned, occupation), target) +
+        CountLanes(FillDiagonal(bishopqueens & own & ~pinned, occupation), target);
+#else
+    for (TBB pieces = bishopqueens & own & ~pinned; pieces; pieces = ClearLSB(pieces)) tot += PopCount(GenBishop(LSB(pieces), occupation) & target);
+    for (TBB pieces = rookqueens & own & ~pinned; pieces; pieces = ClearLSB(pieces)) tot += PopCount(GenRook(LSB(pieces), occupation) & target);
+#endif
+
+    const TBB pieces = pawns & own & ~pinned;
+    const TBB push1 = (pieces << 8) & ~occupation;
+    const TBB push2 = ((push1 & 0x0000000000FF0000ULL) << 8) & ~occupation;
+    const TBB captureri = (pieces << 9) & 0xFEFEFEFEFEFEFEFEULL & opposing;
+    const TBB capturele = (pieces << 7) & 0x7F7F7F7F7F7F7F7FULL & opposing;
+    tot += PopCount(push2 & target);
+    tot += PopCount(push1 & target & 0x00FFFFFFFFFFFFFFULL) + 4 * PopCount(push1 & target & 0xFF00000000000000ULL);
+    tot += PopCount(captureri & target & 0x00FFFFFFFFFFFFFFULL) + 4 * PopCount(captureri & target & 0xFF00000000000000ULL);
+    tot += PopCount(capturele & target & 0x00FFFFFFFFFFFFFFULL) + 4 * PopCount(capturele & target & 0xFF00000000000000ULL);
+
+    if (Position->EnPassant != 8)
+    {
+        TMove move;
+        move.MoveType = PAWN | EP | CAPTURE;
+        move.To = 40 + Position->EnPassant;
+        move.Prom = EMPTY;
+        for (TBB enpassant = pawns & own & EnPassant[Position->EnPassant]; enpassant; enpassant = ClearLSB(enpassant))
         {
-            if (move.To == 6) { Position->PM ^= 0x00000000000000A0ULL; Position->P2 ^= 0x00000000000000A0ULL; } /* short castling */
-            else { Position->P2 ^= 0x0000000000000009ULL; Position->PM ^= 0x0000000000000009ULL; } /* long castling */
+            move.From = LSB(enpassant);
+            if (!Illegal(Position, move)) tot++;
         }
-        ChangeSide;
-    default: break;
     }
+    return tot;
 }
 
-#if defined(_WIN32)
+#if defined(LEGAL_MOVEGEN)
 
-#include <windows.h>
+/* add a move from the square from to every destination, the destinations on opponent pieces are captures */
+static inline TMove* AddMoves(TMove* pmoves, TPieceType piece, uint64_t from, TBB destinations, TBB opposing)
+{
+    for (TBB dest = destinations & opposing; dest; dest = ClearLSB(dest))
+    {
+        pmoves->MoveType = piece | CAPTURE;
+        pmoves->From = from;
+        pmoves->To = LSB(dest);
+        pmoves->Prom = EMPTY;
+        pmoves++;
+    }
+    for (TBB dest = destinations & ~opposing; dest; dest = ClearLSB(dest))
+    {
+        pmoves->MoveType = piece;
+        pmoves->From = from;
+        pmoves->To = LSB(dest);
+        pmoves->Prom = EMPTY;
+        pmoves++;
+    }
+    return pmoves;
+}
 
-#define BILLION                             (1E9)
+/* add the pawn moves to the destinations, shift is the distance from the starting squares,
+   a move to the last row is a promotion to the 4 pieces */
+static inline TMove* AddPawnMoves(TMove* pmoves, TBB destinations, int shift, uint8_t type)
+{
+    for (TBB dest = destinations & 0x00FFFFFFFFFFFFFFULL; dest; dest = ClearLSB(dest))
+    {
+        pmoves->MoveType = PAWN | type;
+        pmoves->From = LSB(dest) - shift;
+        pmoves->To = LSB(dest);
+        pmoves->Prom = EMPTY;
+        pmoves++;
+    }
+    for (TBB dest = destinations & 0xFF00000000000000ULL; dest; dest = ClearLSB(dest))
+    {
+        for (TPieceType piece = QUEEN; piece >= KNIGHT; piece--)
+        {
+            pmoves->MoveType = PAWN | PROMO | type;
+            pmoves->From = LSB(dest) - shift;
+            pmoves->To = LSB(dest);
+            pmoves->Prom = piece;
+            pmoves++;
+        }
+    }
+    return pmoves;
+}
 
-static BOOL g_first_time = 1;
-static LARGE_INTEGER g_counts_per_sec;
+/* add the pushes and the captures of the pawns, only to the target squares */
+static inline TMove* AddPawns(TMove* pmoves, TBB pieces, TBB occupation, TBB opposing, TBB target)
+{
+    const TBB push1 = (pieces << 8) & ~occupation;
+    pmoves = AddPawnMoves(pmoves, (pieces << 9) & 0xFEFEFEFEFEFEFEFEULL & opposing & target, 9, CAPTURE);
+    pmoves = AddPawnMoves(pmoves, (pieces << 7) & 0x7F7F7F7F7F7F7F7FULL & opposing & target, 7, CAPTURE);
+    pmoves = AddPawnMoves(pmoves, push1 & target, 8, 0);
+    return AddPawnMoves(pmoves, ((push1 & 0x0000000000FF0000ULL) << 8) & ~occupation & target, 16, 0);
+}
 
-int gettime(struct timespec* ct)
+/*
+Generate all the legal moves.
+The same masks of CountLegal are used: the king goes only on squares not attacked, with a single check
+the other pieces must capture or block the checker, the pinned pieces move only on the ray of the pin.
+Enpassant can uncover a check on the row of the two pawns, so it's still verified with Illegal.
+*/
+static inline TMove* GenerateLegal(const TBoard* const Position, TMove* const moves)
 {
-    LARGE_INTEGER count;
+    const TBB occupation = Occupation;
+    const TBB own = Position->PM;
+    const TBB opposing = occupation ^ own;
+    const TBB king = Kings & own;
+    const uint64_t kingsq = LSB(king);
+    const TBB checkers = Checkers(Position);
+    const TBB attacked = Attacked(Position);
+
+    TMove* pmoves = AddMoves(moves, KING, kingsq, KingDest[kingsq] & ~own & ~attacked, opposing);
+    if (ClearLSB(checkers)) return pmoves; /* double check, only the king can move */
+
+    TBB target = ~own;
+    if (checkers) target = checkers | Between[kingsq][LSB(checkers)];
+    else
+    {
+        if (CastleSM && !(occupation & 0x60ULL) && !(attacked & 0x60ULL))
+        {
+            pmoves->MoveType = KING | CASTLE;
+            pmoves->From = 4;
+            pmoves->To = 6;
+            pmoves->Prom = EMPTY;
+            pmoves++;
+        }
+        if (CastleLM && !(occupation & 0x0EULL) && !(attacked & 0x0CULL))
+        {
+            pmoves->MoveType = KING | CASTLE;
+            pmoves->From = 4;
+            pmoves->To = 2;
+            pmoves->Prom = EMPTY;
+            pmoves++;
+        }
+    }
 
-    if (g_first_time)
+    TBB pinned = 0;
+    for (TBB snipers = ((GenRook(kingsq, opposing | king) & (Rooks | Queens)) | (GenBishop(kingsq, opposing | king) & (Bishops | Queens))) & opposing;
+        snipers; snipers = ClearLSB(snipers))
     {
-        g_first_time = 0;
+        const uint64_t snipersq = LSB(snipers);
+        const TBB blocker = Between[kingsq][snipersq] & occupation;
+        if (ClearLSB(blocker) || !(blocker & own)) continue;
+        pinned |= blocker;
+        const TBB ray = (Between[kingsq][snipersq] | (1ULL << snipersq)) & target;
+        const uint64_t sq = LSB(blocker);
+        const TPieceType piece = Piece(sq);
+        if (piece == PAWN) pmoves = AddPawns(pmoves, blocker, occupation, opposing, ray);
+        else if (piece != KNIGHT) pmoves = AddMoves(pmoves, piece, sq, BBDestinations(piece, sq, occupation) & ray, opposing);
+    }
 
-        if (0 == QueryPerformanceFrequency(&g_counts_per_sec))
+    for (TPieceType piece = QUEEN; piece >= KNIGHT; piece--)
+    {
+        for (TBB pieces = BBPieces(Position, piece) & own & ~pinned; pieces; pieces = ClearLSB(pieces))
         {
-            g_counts_per_sec.QuadPart = 0;
+            const uint64_t sq = LSB(pieces);
+            pmoves = AddMoves(pmoves, piece, sq, BBDestinations(piece, sq, occupation) & target, opposing);
         }
     }
+    pmoves = AddPawns(pmoves, Pawns & own & ~pinned, occupation, opposing, target);
 
-    if ((NULL == ct) || (g_counts_per_sec.QuadPart <= 0) ||
-        (0 == QueryPerformanceCounter(&count)))
+    if (Position->EnPassant != 8)
     {
-        return -1;
+        for (TBB enpassant = Pawns & own & EnPassant[Position->EnPassant]; enpassant; enpassant = ClearLSB(enpassant))
+        {
+            pmoves->MoveType = PAWN | EP | CAPTURE;
+            pmoves->From = LSB(enpassant);
+            pmoves->To = 40 + Position->EnPassant;
+            pmoves->Prom = EMPTY;
+            if (!Illegal(Position, *pmoves)) pmoves++;
+        }
     }
+    return pmoves;
+}
 
-    ct->tv_sec = count.QuadPart / g_counts_per_sec.QuadPart;
-    ct->tv_nsec = ((count.QuadPart % g_counts_per_sec.QuadPart) * BILLION) / g_counts_per_sec.QuadPart;
+#endif
 
-    return 0;
+/*
+Make routines specialized for every kind of move: the generators used by Perft emit the moves grouped by kind,
+so Perft calls the routine of the group without testing the MoveType bits of every move. Make is the same for
+a single move of any kind. Every routine copies the position into the next one and the caller takes the
+move back with Unmake, that goes back to the previous position.
+The castle rights are updated with CastleKeep on the squares that the move leaves or captures: while a right is
+there, the king and the rook are still on their squares, so the masks of the other pieces are never used.
+*/
+typedef enum { MAKE_QUIET, MAKE_CAPTURE, MAKE_PUSH, MAKE_DOUBLE_PUSH, MAKE_EP, MAKE_PROMOTION, MAKE_CASTLE } TMakeKind;
+
+static const uint8_t CastleKeep[64] = {
+    0xFE,0xFF,0xFF,0xFF,0xFC,0xFF,0xFF,0xFD, /* a1 long, e1 both, h1 short castling of the side to move */
+    0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+    0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+    0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+    0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+    0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+    0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+    0xEF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xDF }; /* a8 long, h8 short castling of the opponent */
+
+/* a knight, bishop, rook, queen or king to an empty square */
+static inline void MakeQuiet(TSearch* const search, TMove move)
+{
+    TBoard* const Position = ++search->Position;
+    *Position = *(Position - 1);
+    const TBB fromto = (1ULL << move.From) | (1ULL << move.To);
+    Position->PM ^= fromto;
+    Position->P0 ^= (move.MoveType & 1) ? fromto : 0;
+    Position->P1 ^= (move.MoveType & 2) ? fromto : 0;
+    Position->P2 ^= (move.MoveType & 4) ? fromto : 0;
+    Position->EnPassant = 8;
+    Position->CastleFlags &= CastleKeep[move.From];
+    ChangeSide;
 }
 
-#else
+/* a piece or a pawn that captures without promoting */
+static inline void MakeCapture(TSearch* const search, TMove move)
+{
+    TBoard* const Position = ++search->Position;
+    *Position = *(Position - 1);
+    const TBB dest = 1ULL << move.To;
+    const TBB fromto = (1ULL << move.From) | dest;
+    Position->P0 &= ~dest; /* delete the captured piece */
+    Position->P1 &= ~dest;
+    Position->P2 &= ~dest;
+    Position->PM ^= fromto;
+    Position->P0 ^= (move.MoveType & 1) ? fromto : 0;
+    Position->P1 ^= (move.MoveType & 2) ? fromto : 0;
+    Position->P2 ^= (move.MoveType & 4) ? fromto : 0;
+    Position->EnPassant = 8;
+    Position->CastleFlags &= CastleKeep[move.From] & CastleKeep[move.To];
+    ChangeSide;
+}
 
-int gettime(struct timespec* ct)
+/* a pawn push of one square */
+static inline void MakePush(TSearch* const search, TMove move)
 {
-    clock_gettime(CLOCK_MONOTONIC, ct);
+    TBoard* const Position = ++search->Position;
+    *Position = *(Position - 1);
+    const TBB fromto = (1ULL << move.From) | (1ULL << move.To);
+    Position->PM ^= fromto;
+    Position->P0 ^= fromto;
+    Position->EnPassant = 8;
+    ChangeSide;
 }
 
-#endif
+/* a pawn push of two squares, the enpassant column is saved only if an opponent pawn can capture */
+static inline void MakeDoublePush(TSearch* const search, TMove move)
+{
+    TBoard* const Position = ++search->Position;
+    *Position = *(Position - 1);
+    const TBB fromto = (1ULL << move.From) | (1ULL << move.To);
+    Position->PM ^= fromto;
+    Position->P0 ^= fromto;
+    Position->EnPassant = (EnPassantM[move.To & 0x07] & Pawns & (Position->PM ^ (Occupation))) ? move.To & 0x07 : 8;
+    ChangeSide;
+}
 
-/*
-Load a position starting from a fen and a list of moves.
-This function doesn't check the correctness of the fen and the moves sent.
-*/
-static void LoadPosition(const char* fen, char* moves)
+static inline void MakeEnPassant(TSearch* const search, TMove move)
 {
-    /* Clear the board */
-    Position = Game;
+    TBoard* const Position = ++search->Position;
+    *Position = *(Position - 1);
+    const TBB dest = 1ULL << move.To;
+    const TBB fromto = (1ULL << move.From) | dest;
+    Position->PM ^= fromto;
+    Position->P0 ^= fromto;
+    Position->P0 ^= dest >> 8; /* delete the captured pawn */
+    Position->EnPassant = 8;
+    ChangeSide;
+}
+
+/* a promotion with or without capture */
+static inline void MakePromotion(TSearch* const search, TMove move)
+{
+    TBoard* const Position = ++search->Position;
+    *Position = *(Position - 1);
+    const TBB part = 1ULL << move.From;
+    const TBB dest = 1ULL << move.To;
+    Position->P0 &= ~dest; /* delete the captured piece, if any */
+    Position->P1 &= ~dest;
+    Position->P2 &= ~dest;
+    Position->PM ^= part | dest;
+    Position->P0 ^= part;
+    Position->P0 |= (TBB)(move.Prom & 1) << (move.To);
+    Position->P1 |= (TBB)(((move.Prom) >> 1) & 1) << (move.To);
+    Position->P2 |= (TBB)((move.Prom) >> 2) << (move.To);
+    Position->EnPassant = 8;
+    Position->CastleFlags &= CastleKeep[move.To];
+    ChangeSide;
+}
+
+static inline void MakeCastle(TSearch* const search, TMove move)
+{
+    TBoard* const Position = ++search->Position;
+    *Position = *(Position - 1);
+    const TBB fromto = (1ULL << move.From) | (1ULL << move.To);
+    const TBB rook = move.To == 6 ? 0x00000000000000A0ULL : 0x0000000000000009ULL; /* short or long castling */
+    Position->PM ^= fromto | rook;
+    Position->P1 ^= fromto;
+    Position->P2 ^= fromto | rook;
+    Position->EnPassant = 8;
+    ResetCastleSM; /* update the castle rights */
+    ResetCastleLM;
+    ChangeSide;
+}
+
+#if !defined(UNDO_MAKE)
+/* make a move of the given kind, the switch disappears when the kind is a constant */
+static inline void MakeKind(TSearch* const search, TMove move, TMakeKind kind)
+{
+    switch (kind)
+    {
+    case MAKE_QUIET: MakeQuiet(search, move); break;
+    case MAKE_CAPTURE: MakeCapture(search, move); break;
+    case MAKE_PUSH: MakePush(search, move); break;
+    case MAKE_DOUBLE_PUSH: MakeDoublePush(search, move); break;
+    case MAKE_EP: MakeEnPassant(search, move); break;
+    case MAKE_PROMOTION: MakePromotion(search, move); break;
+    case MAKE_CASTLE: MakeCastle(search, move); break;
+    }
+}
+#endif
+
+#if !defined(UNDO_MAKE)
+
+/* Make the move of any kind, the caller takes it back with Unmake */
+static inline void Make(TSearch* const search, TMove move)
+{
+    if (move.MoveType & CASTLE) MakeCastle(search, move);
+    else if (move.MoveType & EP) MakeEnPassant(search, move);
+    else if (move.MoveType & PROMO) MakePromotion(search, move);
+    else if (move.MoveType & CAPTURE) MakeCapture(search, move);
+    else if ((move.MoveType & 0x07) != PAWN) MakeQuiet(search, move);
+    else if (move.To == move.From + 16) MakeDoublePush(search, move);
+    else MakePush(search, move);
+}
+
+/* the previous position is still there */
+static inline void Unmake(TSearch* const search, TMove move)
+{
+    (void)move;
+    search->Position--;
+}
+
+#define ResetUndo(search)
+
+#else
+
+/*
+Make and unmake in place (-DUNDO_MAKE): the move changes the bits of the position without copying it, and saves in
+the undo stack the castle rights, the enpassant column and the captured piece, that Unmake puts back after
+changing the side again and xoring the same bits of the move. Like in the copy make the groups of Perft give the
+kind as a constant, so only the captures look for a captured piece and only the pieces that can change the castle
+rights update them.
+*/
+static inline void MakeKind(TSearch* const search, TMove move, TMakeKind kind)
+{
+    TBoard* const Position = search->Position;
+    TUndo* const undo = search->UndoTop++;
+    const TBB part = 1ULL << move.From;
+    const TBB dest = 1ULL << move.To;
+    undo->CastleFlags = Position->CastleFlags;
+    undo->EnPassant = Position->EnPassant;
+    undo->Captured = EMPTY;
+    Position->EnPassant = 8;
+    if (kind == MAKE_CAPTURE || kind == MAKE_PROMOTION)
+    {   /* delete the captured piece, if any */
+        undo->Captured = (uint8_t)(((Position->P0 >> move.To) & 1) | (((Position->P1 >> move.To) & 1) << 1) | (((Position->P2 >> move.To) & 1) << 2));
+        Position->P0 &= ~dest;
+        Position->P1 &= ~dest;
+        Position->P2 &= ~dest;
+    }
+    if (kind == MAKE_QUIET || kind == MAKE_CAPTURE || kind == MAKE_PROMOTION || kind == MAKE_CASTLE)
+        Position->CastleFlags &= CastleKeep[move.From] & CastleKeep[move.To];
+    Position->PM ^= part | dest;
+    if (kind == MAKE_PROMOTION)
+    {
+        Position->P0 ^= part;
+        Position->P0 |= (TBB)(move.Prom & 1) << (move.To);
+        Position->P1 |= (TBB)(((move.Prom) >> 1) & 1) << (move.To);
+        Position->P2 |= (TBB)((move.Prom) >> 2) << (move.To);
+    }
+    else if (kind == MAKE_PUSH || kind == MAKE_DOUBLE_PUSH || kind == MAKE_EP) Position->P0 ^= part | dest;
+    else if (kind == MAKE_CASTLE)
+    {
+        const TBB rook = move.To == 6 ? 0x00000000000000A0ULL : 0x0000000000000009ULL; /* short or long castling */
+        Position->PM ^= rook;
+        Position->P1 ^= part | dest;
+        Position->P2 ^= part | dest | rook;
+    }
+    else
+    {
+        Position->P0 ^= (move.MoveType & 1) ? part | dest : 0;
+        Position->P1 ^= (move.MoveType & 2) ? part | dest : 0;
+        Position->P2 ^= (move.MoveType & 4) ? part | dest : 0;
+    }
+    if (kind == MAKE_EP) Position->P0 ^= dest >> 8; /* delete the captured pawn */
+    if (kind == MAKE_DOUBLE_PUSH && EnPassantM[move.To & 0x07] & Pawns & (Position->PM ^ (Occupation)))
+        Position->EnPassant = move.To & 0x07; /* save enpassant column */
+    ChangeSide;
+}
+
+/* Make the move of any kind, the caller takes it back with Unmake */
+static inline void Make(TSearch* const search, TMove move)
+{
+    if (move.MoveType & CASTLE) MakeKind(search, move, MAKE_CASTLE);
+    else if (move.MoveType & EP) MakeKind(search, move, MAKE_EP);
+    else if (move.MoveType & PROMO) MakeKind(search, move, MAKE_PROMOTION);
+    else if (move.MoveType & CAPTURE) MakeKind(search, move, MAKE_CAPTURE);
+    else if ((move.MoveType & 0x07) != PAWN) MakeKind(search, move, MAKE_QUIET);
+    else if (move.To == move.From + 16) MakeKind(search, move, MAKE_DOUBLE_PUSH);
+    else MakeKind(search, move, MAKE_PUSH);
+}
+
+static inline void Unmake(TSearch* const search, TMove move)
+{
+    TBoard* const Position = search->Position;
+    const TUndo* const undo = --search->UndoTop;
+    const TBB part = 1ULL << move.From;
+    const TBB dest = 1ULL << move.To;
+    Position->P0 = RevBB(Position->P0); /* change the side back */
+    Position->P1 = RevBB(Position->P1);
+    Position->P2 = RevBB(Position->P2);
+    Position->PM = RevBB(Position->PM) ^ Occupation;
+    Position->STM ^= BLACK;
+    Position->CastleFlags = undo->CastleFlags;
+    Position->EnPassant = undo->EnPassant;
+    if (move.MoveType & PROMO)
+    {
+        Position->P0 &= ~dest; /* delete the promoted piece and put back the pawn */
+        Position->P1 &= ~dest;
+        Position->P2 &= ~dest;
+        Position->PM ^= part | dest;
+        Position->P0 ^= part;
+    }
+    else
+    {
+        Position->PM ^= part | dest;
+        Position->P0 ^= (move.MoveType & 1) ? part | dest : 0;
+        Position->P1 ^= (move.MoveType & 2) ? part | dest : 0;
+        Position->P2 ^= (move.MoveType & 4) ? part | dest : 0;
+        if (move.MoveType & EP) Position->P0 ^= dest >> 8; /* put back the captured pawn */
+        else if (move.MoveType & CASTLE)
+        {
+            const TBB rook = move.To == 6 ? 0x00000000000000A0ULL : 0x0000000000000009ULL;
+            Position->PM ^= rook;
+            Position->P2 ^= rook;
+        }
+    }
+    Position->P0 |= (TBB)(undo->Captured & 1) << move.To; /* put back the captured piece */
+    Position->P1 |= (TBB)((undo->Captured >> 1) & 1) << move.To;
+    Position->P2 |= (TBB)(undo->Captured >> 2) << move.To;
+}
+
+#define ResetUndo(search) ((search)->UndoTop = (search)->Undo)
+
+#endif
+
+/* Zobrist keys for every bit of PM,P0,P1,P2, for the castle flags, for the enpassant column and for the side to move.
+   The key is computed on the board as it is saved, with the side to move in the lower part of the bitboards */
+static TBB Zobrist[4][64];
+static TBB ZobristCastle[256];
+static TBB ZobristEnPassant[9]; /* the key for the column 8 (enpassant not set) is 0 */
+static TBB ZobristSTM;
+
+/* xorshift64* pseudo random number generator */
+static uint64_t Rand64(uint64_t* const state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void InitZobrist(void)
+{
+    uint64_t state = 0x9E3779B97F4A7C15ULL; /* fixed seed, the keys are the same on every run */
+    for (int i = 0; i < 4; i++)
+        for (int sq = 0; sq < 64; sq++) Zobrist[i][sq] = Rand64(&state);
+    for (int i = 0; i < 256; i++) ZobristCastle[i] = Rand64(&state);
+    for (int i = 0; i < 8; i++) ZobristEnPassant[i] = Rand64(&state);
+    ZobristEnPassant[8] = 0;
+    ZobristSTM = Rand64(&state);
+}
+
+/* compute the hash key of the board */
+static inline TBB HashKey(const TBoard* const Position)
+{
+    TBB key = ZobristCastle[Position->CastleFlags] ^ ZobristEnPassant[Position->EnPassant] ^ (Position->STM ? ZobristSTM : 0);
+    for (TBB bb = Position->PM; bb; bb = ClearLSB(bb)) key ^= Zobrist[0][LSB(bb)];
+    for (TBB bb = Position->P0; bb; bb = ClearLSB(bb)) key ^= Zobrist[1][LSB(bb)];
+    for (TBB bb = Position->P1; bb; bb = ClearLSB(bb)) key ^= Zobrist[2][LSB(bb)];
+    for (TBB bb = Position->P2; bb; bb = ClearLSB(bb)) key ^= Zobrist[3][LSB(bb)];
+    return key;
+}
+
+/* look for the count of the subtree of the position with this key and depth */
+static inline int ProbeHash(const THashTable* const hash, TBB key, int depth, int64_t* const count)
+{
+    THashEntry* const bucket = hash->Buckets[key & hash->Mask].Entry;
+    for (int i = 0; i < 4; i++)
+    {
+        const uint64_t data = AtomicLoad64(&bucket[i].Data);
+        const TBB check = AtomicLoad64(&bucket[i].Check);
+        if ((check ^ data) == key && (int)(data & 0xFF) == depth)
+        {
+            *count = (int64_t)(data >> 8);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* save the count of a subtree, it replaces the entry with the lowest depth of the bucket */
+static inline void StoreHash(THashTable* const hash, TBB key, int depth, int64_t count)
+{
+    THashEntry* const bucket = hash->Buckets[key & hash->Mask].Entry;
+    THashEntry* replace = &bucket[0];
+    uint64_t lowest = AtomicLoad64(&bucket[0].Data) & 0xFF;
+    for (int i = 1; i < 4; i++)
+    {
+        const uint64_t entrydepth = AtomicLoad64(&bucket[i].Data) & 0xFF;
+        if (entrydepth < lowest) { lowest = entrydepth; replace = &bucket[i]; }
+    }
+    const uint64_t data = (uint64_t)count << 8 | (uint64_t)depth;
+    AtomicStore64(&replace->Data, data);
+    AtomicStore64(&replace->Check, key ^ data);
+}
+
+/* the rest of the file up to Perft is the driver, a kernel object of the runtime dispatch doesn't compile it */
+#if !defined(KERNEL_VARIANT)
+
+#if defined(_WIN32)
+
+#include <windows.h>
+#include <io.h>
+
+#define BILLION                             (1E9)
+
+static BOOL g_first_time = 1;
+static LARGE_INTEGER g_counts_per_sec;
+
+static int gettime(struct timespec* ct)
+{
+    LARGE_INTEGER count;
+
+    if (g_first_time)
+    {
+        g_first_time = 0;
+
+        if (0 == QueryPerformanceFrequency(&g_counts_per_sec))
+        {
+            g_counts_per_sec.QuadPart = 0;
+        }
+    }
+
+    if ((NULL == ct) || (g_counts_per_sec.QuadPart <= 0) ||
+        (0 == QueryPerformanceCounter(&count)))
+    {
+        return -1;
+    }
+
+    ct->tv_sec = count.QuadPart / g_counts_per_sec.QuadPart;
+    ct->tv_nsec = ((count.QuadPart % g_counts_per_sec.QuadPart) * BILLION) / g_counts_per_sec.QuadPart;
+
+    return 0;
+}
+
+#else
+
+static int gettime(struct timespec* ct)
+{
+    return clock_gettime(CLOCK_MONOTONIC, ct);
+}
+
+#endif
+
+/* nanoseconds from begin to end */
+static int64_t ElapsedNs(const struct timespec* const begin, const struct timespec* const end)
+{
+    return (int64_t)(end->tv_sec - begin->tv_sec) * 1000000000 + (end->tv_nsec - begin->tv_nsec);
+}
+
+/* allocate memory aligned to the cache line, for the structures with ALIGNED(CACHE_LINE), freed with FreeAligned */
+static void* AllocAligned(size_t size)
+{
+#if defined(_WIN32)
+    return _aligned_malloc(size, CACHE_LINE);
+#else
+    void* memory;
+    return posix_memalign(&memory, CACHE_LINE, size) ? NULL : memory;
+#endif
+}
+
+static void FreeAligned(void* memory)
+{
+#if defined(_WIN32)
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+/* map a whole file in memory read only, return NULL if it fails or the file is empty */
+#if defined(_WIN32)
+
+static const char* MapFile(const char* filename, size_t* const size)
+{
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+    LARGE_INTEGER length;
+    const char* data = NULL;
+    if (GetFileSizeEx(file, &length) && length.QuadPart > 0)
+    {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping)
+        {
+            data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping); /* the view keeps the mapping */
+        }
+        *size = (size_t)length.QuadPart;
+    }
+    CloseHandle(file);
+    return data;
+}
+
+static void UnmapFile(const char* data, size_t size)
+{
+    (void)size;
+    UnmapViewOfFile(data);
+}
+
+static const char* HostName(void)
+{
+    const char* name = getenv("COMPUTERNAME");
+    return name ? name : "unknown";
+}
+
+/* send what is printed on the standard output to the standard error, return a stream on the standard output */
+static FILE* SeparateStdout(void)
+{
+    const int original = _dup(_fileno(stdout));
+    fflush(stdout);
+    _dup2(_fileno(stderr), _fileno(stdout));
+    return _fdopen(original, "w");
+}
+
+/* allocate size bytes of zeroed memory with large pages if possible (the process needs the "lock pages in memory"
+   privilege), backing tells which pages were used */
+static void* AllocLarge(size_t size, const char** const backing)
+{
+    const size_t large = GetLargePageMinimum();
+    void* memory;
+    if (large && !(size % large))
+    {
+        memory = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (memory)
+        {
+            *backing = "large pages";
+            return memory;
+        }
+    }
+    *backing = "normal pages";
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+static void FreeLarge(void* memory, size_t size)
+{
+    (void)size;
+    VirtualFree(memory, 0, MEM_RELEASE);
+}
+
+/* map a file read-write and shared, the writes go to the cache of the system and to the file.
+   If *size is 0 the whole file is mapped and *size is set (a missing file isn't created), otherwise the file is
+   recreated with *size zero bytes */
+static void* MapSharedFile(const char* filename, uint64_t* const size)
+{
+    HANDLE file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, *size ? OPEN_ALWAYS : OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+    LARGE_INTEGER length;
+    void* data = NULL;
+    int ok = GetFileSizeEx(file, &length);
+    if (ok && *size)
+    {   /* truncate and extend, the new bytes are zeroes */
+        LARGE_INTEGER position;
+        position.QuadPart = 0;
+        ok = SetFilePointerEx(file, position, NULL, FILE_BEGIN) && SetEndOfFile(file);
+        position.QuadPart = (LONGLONG)*size;
+        ok = ok && SetFilePointerEx(file, position, NULL, FILE_BEGIN) && SetEndOfFile(file);
+        length = position;
+    }
+    if (ok && length.QuadPart > 0)
+    {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, 0, NULL);
+        if (mapping)
+        {
+            data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+            CloseHandle(mapping); /* the view keeps the mapping */
+        }
+        *size = (uint64_t)length.QuadPart;
+    }
+    CloseHandle(file);
+    return data;
+}
+
+#else
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char* MapFile(const char* filename, size_t* const size)
+{
+    int file = open(filename, O_RDONLY);
+    if (file < 0) return NULL;
+    struct stat info;
+    const char* data = NULL;
+    if (!fstat(file, &info) && info.st_size > 0)
+    {
+        void* map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, (size_t)info.st_size, MADV_SEQUENTIAL);
+            data = map;
+        }
+        *size = (size_t)info.st_size;
+    }
+    close(file); /* the mapping keeps the file */
+    return data;
+}
+
+static void UnmapFile(const char* data, size_t size)
+{
+    munmap((void*)data, size);
+}
+
+static const char* HostName(void)
+{
+    static char name[256];
+    if (gethostname(name, sizeof(name) - 1)) return "unknown";
+    return name;
+}
+
+/* send what is printed on the standard output to the standard error, return a stream on the standard output */
+static FILE* SeparateStdout(void)
+{
+    const int original = dup(fileno(stdout));
+    fflush(stdout);
+    dup2(fileno(stderr), fileno(stdout));
+    return fdopen(original, "w");
+}
+
+#define HUGE_PAGE (2 << 20)
+
+/*
+Allocate size bytes of zeroed memory with huge pages if possible, backing tells which pages were used:
+the reserved huge pages of MAP_HUGETLB (vm.nr_hugepages), otherwise the transparent huge pages asked with
+madvise, otherwise the normal pages. The pages are only reserved, they are faulted in when first written.
+*/
+static void* AllocLarge(size_t size, const char** const backing)
+{
+    void* memory;
+#if defined(MAP_HUGETLB)
+    if (!(size % HUGE_PAGE))
+    {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED)
+        {
+            *backing = "huge pages (MAP_HUGETLB)";
+            return memory;
+        }
+    }
+#endif
+    *backing = "normal pages";
+    if (size < HUGE_PAGE)
+    {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return memory == MAP_FAILED ? NULL : memory;
+    }
+    /* a transparent huge page needs an aligned address: map a page more and unmap the ends */
+    char* const map = mmap(NULL, size + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return NULL;
+    char* const aligned = (char*)(((uintptr_t)map + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+    if (aligned > map) munmap(map, aligned - map);
+    if (aligned + size < map + size + HUGE_PAGE) munmap(aligned + size, map + size + HUGE_PAGE - (aligned + size));
+#if defined(MADV_HUGEPAGE)
+    if (!madvise(aligned, size, MADV_HUGEPAGE)) *backing = "transparent huge pages (madvise)";
+#endif
+    return aligned;
+}
+
+static void FreeLarge(void* memory, size_t size)
+{
+    munmap(memory, size);
+}
+
+/* map a file read-write and shared, the writes go to the page cache and from there to the file.
+   If *size is 0 the whole file is mapped and *size is set (a missing file isn't created), otherwise the file is
+   recreated with *size zero bytes */
+static void* MapSharedFile(const char* filename, uint64_t* const size)
+{
+    int file = open(filename, *size ? O_RDWR | O_CREAT : O_RDWR, 0644);
+    if (file < 0) return NULL;
+    struct stat info;
+    void* data = NULL;
+    int ok = !fstat(file, &info);
+    if (ok && *size)
+    {   /* truncate and extend, the new bytes are zeroes */
+        ok = !ftruncate(file, 0) && !ftruncate(file, (off_t)*size);
+        info.st_size = (off_t)*size;
+    }
+    if (ok && info.st_size > 0)
+    {
+        void* map = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+        if (map != MAP_FAILED) data = map;
+        *size = (uint64_t)info.st_size;
+    }
+    close(file); /* the mapping keeps the file */
+    return data;
+}
+
+#endif
+
+/* minimal threads interface: a thread procedure is declared with THREAD_PROC and receives a pointer */
+#if defined(_WIN32)
+
+typedef HANDLE TThread;
+typedef CRITICAL_SECTION TMutex;
+#define THREAD_PROC(name,param) DWORD WINAPI name(LPVOID param)
+#define InitMutex(mutex) InitializeCriticalSection(mutex)
+#define DestroyMutex(mutex) DeleteCriticalSection(mutex)
+#define LockMutex(mutex) EnterCriticalSection(mutex)
+#define UnlockMutex(mutex) LeaveCriticalSection(mutex)
+#define YieldThread() SwitchToThread()
+#define SleepMs(ms) Sleep(ms)
+
+static void StartThread(TThread* thread, LPTHREAD_START_ROUTINE proc, void* param)
+{
+    *thread = CreateThread(NULL, 0, proc, param, 0, NULL);
+}
+
+static void JoinThread(TThread thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+#else
+
+#include <pthread.h>
+#include <sched.h>
+
+typedef pthread_t TThread;
+typedef pthread_mutex_t TMutex;
+#define THREAD_PROC(name,param) void* name(void* param)
+#define InitMutex(mutex) pthread_mutex_init(mutex, NULL)
+#define DestroyMutex(mutex) pthread_mutex_destroy(mutex)
+#define LockMutex(mutex) pthread_mutex_lock(mutex)
+#define UnlockMutex(mutex) pthread_mutex_unlock(mutex)
+#define YieldThread() sched_yield()
+#define SleepMs(ms) usleep((ms) * 1000)
+
+static void StartThread(TThread* thread, void* (*proc)(void*), void* param)
+{
+    pthread_create(thread, NULL, proc, param);
+}
+
+static void JoinThread(TThread thread)
+{
+    pthread_join(thread, NULL);
+}
+
+#endif
+
+/* number of threads used by the Perft, set with -t */
+static int Threads = 1;
+/* below this ply the subtrees are searched by a single thread, set with -s */
+static int SplitPly = 2;
+/* hash tables of the subtree counts, NULL if the hash is not used (--hash).
+   With a shared table all the threads use HashTables[0], with --hash-per-thread the thread i uses HashTables[i] */
+static THashTable* HashTables = NULL;
+static int HashTableCount = 0;
+
+/* allocate a hash table of size bytes, the number of buckets is rounded down to a power of two */
+static int AllocHash(THashTable* const hash, uint64_t size)
+{
+    uint64_t buckets = size / sizeof(THashBucket);
+    if (!buckets) return 0;
+    while (buckets & (buckets - 1)) buckets = ClearLSB(buckets);
+    hash->Buckets = AllocLarge(buckets * sizeof(THashBucket), &hash->Backing);
+    if (!hash->Buckets) return 0;
+    hash->Mask = buckets - 1;
+    return 1;
+}
+
+static void FreeHashTables(void)
+{
+    for (int i = 0; i < HashTableCount; i++)
+    {
+        const uint64_t size = (HashTables[i].Mask + 1) * sizeof(THashBucket);
+        if (HashTables[i].File) UnmapFile(HashTables[i].File, HASH_FILE_HEADER + size);
+        else if (HashTables[i].Buckets) FreeLarge(HashTables[i].Buckets, size);
+    }
+    free(HashTables);
+    HashTables = NULL;
+    HashTableCount = 0;
+}
+
+/* the thread Index of Count clears its part of every table */
+typedef struct
+{
+    int Index;
+    int Count;
+} THashSlice;
+
+static THREAD_PROC(ClearHashSlice, param)
+{
+    const THashSlice* const slice = param;
+    for (int i = 0; i < HashTableCount; i++)
+    {
+        const uint64_t buckets = HashTables[i].Mask + 1;
+        const uint64_t first = buckets * slice->Index / slice->Count, last = buckets * (slice->Index + 1) / slice->Count;
+        memset(HashTables[i].Buckets + first, 0, (last - first) * sizeof(THashBucket));
+    }
+    return 0;
+}
+
+/*
+Empty the hash tables on threads threads, so that a benchmark run doesn't find the counts of the previous one.
+After the allocation it faults in the pages: the kernel zeroes them on the first write, on many cores together
+*/
+static void ClearHashTables(int threads)
+{
+    THashSlice* const slices = malloc(threads * sizeof(THashSlice));
+    TThread* const threadsid = malloc(threads * sizeof(TThread));
+    for (int i = 0; i < threads; i++)
+    {
+        slices[i].Index = i;
+        slices[i].Count = threads;
+        if (i) StartThread(&threadsid[i], ClearHashSlice, &slices[i]);
+    }
+    ClearHashSlice(&slices[0]);
+    for (int i = 1; i < threads; i++) JoinThread(threadsid[i]);
+    free(threadsid);
+    free(slices);
+}
+
+/* allocate mb megabytes of hash for the threads, in a shared table or divided between a table for every thread,
+   the pages are faulted in by the threads */
+static int InitHashTables(uint64_t mb, int threads, int shared)
+{
+    FreeHashTables();
+    HashTableCount = shared ? 1 : threads;
+    HashTables = calloc(HashTableCount, sizeof(THashTable));
+    for (int i = 0; i < HashTableCount; i++)
+    {
+        if (!AllocHash(&HashTables[i], (mb << 20) / HashTableCount))
+        {
+            FreeHashTables();
+            return 0;
+        }
+    }
+    ClearHashTables(threads);
+    return 1;
+}
+
+/* a fingerprint of all the Zobrist keys, the counts in a hash file are valid only with the same keys */
+static uint64_t ZobristFingerprint(void)
+{
+    uint64_t fingerprint = 0xCBF29CE484222325ULL;
+    const TBB* const tables[] = { &Zobrist[0][0], ZobristCastle, ZobristEnPassant, &ZobristSTM };
+    const int sizes[] = { 4 * 64, 256, 9, 1 };
+    for (int t = 0; t < 4; t++)
+        for (int i = 0; i < sizes[t]; i++) fingerprint = (fingerprint ^ tables[t][i]) * 0x100000001B3ULL;
+    return fingerprint;
+}
+
+/*
+Map the shared hash table from a file, so that the counts of a run are found by the next ones.
+A file with a valid header is reused with its size, otherwise it's recreated empty with mb megabytes
+(rounded down to a power of two). The file isn't written explicitly: the counts stored by the search go
+to the page cache and the system writes them back to the file, also if the program is killed.
+*/
+static int OpenHashFile(const char* filename, uint64_t mb)
+{
+    THashFileHeader expected;
+    memset(&expected, 0, sizeof(expected));
+    memcpy(expected.Magic, HASH_FILE_MAGIC, sizeof(HASH_FILE_MAGIC));
+    expected.Version = HASH_FILE_VERSION;
+    expected.EntrySize = sizeof(THashEntry);
+    expected.BucketEntries = sizeof(THashBucket) / sizeof(THashEntry);
+    expected.DepthBits = 8;
+    expected.KeyScheme = ZobristFingerprint();
+
+    FreeHashTables();
+    HashTableCount = 1;
+    HashTables = calloc(1, sizeof(THashTable));
+    THashTable* const hash = &HashTables[0];
+    uint64_t size = 0;
+    THashFileHeader* header = MapSharedFile(filename, &size);
+    if (header)
+    {
+        expected.Buckets = header->Buckets;
+        const int valid = size >= HASH_FILE_HEADER + sizeof(THashBucket) && !memcmp(header, &expected, sizeof(expected))
+            && !(header->Buckets & (header->Buckets - 1)) && size == HASH_FILE_HEADER + header->Buckets * sizeof(THashBucket);
+        if (valid) hash->Backing = "file, reused";
+        else
+        {
+            printf("The hash file %s has another format or is damaged, it's recreated\r\n", filename);
+            UnmapFile((const char*)header, size);
+            header = NULL;
+        }
+    }
+    if (!header)
+    {
+        uint64_t buckets = (mb << 20) / sizeof(THashBucket);
+        if (!buckets)
+        {
+            printf("Give the size of the new hash file %s with --hash\r\n", filename);
+            FreeHashTables();
+            return 0;
+        }
+        while (buckets & (buckets - 1)) buckets = ClearLSB(buckets);
+        size = HASH_FILE_HEADER + buckets * sizeof(THashBucket);
+        header = MapSharedFile(filename, &size);
+        if (!header)
+        {
+            FreeHashTables();
+            return 0;
+        }
+        /* the header is written last: a file left by a crash during the creation is recreated */
+        expected.Buckets = buckets;
+        *header = expected;
+        hash->Backing = "file, new";
+    }
+    hash->File = header;
+    hash->Buckets = (THashBucket*)((char*)header + HASH_FILE_HEADER);
+    hash->Mask = header->Buckets - 1;
+    return 1;
+}
+
+/* megabytes of hash allocated, after the rounding of the tables */
+static uint64_t HashMB(void)
+{
+    return HashTables ? ((HashTables[0].Mask + 1) * sizeof(THashBucket) * HashTableCount) >> 20 : 0;
+}
+
+/* write the legal moves of the position in the same order of Perft and return the end of the list,
+   the move buffers of the search for this depth are used by the generators */
+static TMove* LegalMoves(TSearch* const search, int depth, TMove* pmoves)
+{
+    const TBoard* const Position = search->Position;
+    TMove* const quiets = search->Quiets[depth];
+#if defined(LEGAL_MOVEGEN)
+    for (TMove* plegal = GenerateLegal(Position, quiets); plegal > quiets; plegal--) *pmoves++ = *(plegal - 1);
+#else
+    TMoveEval* const capture = search->Capture[depth];
+    TMoveEval* captureends[3];
+    TMove* quietends[4];
+    for (TMoveEval* pcapture = GenerateCapture(Position, capture, captureends); pcapture > capture; pcapture--)
+        if (!Illegal(Position, (pcapture - 1)->Move)) *pmoves++ = (pcapture - 1)->Move;
+    for (TMove* pquiets = GenerateQuiets(Position, quiets, quietends); pquiets > quiets; pquiets--)
+        if (!Illegal(Position, *(pquiets - 1))) *pmoves++ = *(pquiets - 1);
+#endif
+    return pmoves;
+}
+
+/* write the move in long algebraic notation, stm is the side to move of the position of the move */
+static char* MoveToStr(TMove move, uint8_t stm, char* const str)
+{
+    const int from = AbsSq(move.From, stm);
+    const int to = AbsSq(move.To, stm);
+    str[0] = 'a' + (from & 0x07);
+    str[1] = '1' + (from >> 3);
+    str[2] = 'a' + (to & 0x07);
+    str[3] = '1' + (to >> 3);
+    str[4] = (move.MoveType & PROMO) ? " pnbrq"[move.Prom] : 0;
+    str[5] = 0;
+    return str;
+}
+
+/*
+Load the position of the fen that ends at end, that doesn't need to be NUL terminated (the fens of an EPD suite
+are parsed inside the mapped file). This function doesn't check the correctness of the fen, it returns 0 only if
+the side to move or the castle rights are missing.
+*/
+static int LoadFen(TSearch* const search, const char* fen, const char* const end)
+{
+    /* Clear the board */
+    TBoard* const Position = search->Position = search->Game;
+    ResetUndo(search);
     Position->P0 = Position->P1 = Position->P2 = Position->PM = 0;
     Position->EnPassant = 8;
     Position->STM = WHITE;
     Position->CastleFlags = 0;
 
-    /* translate the fen to the relative position */
-    uint8_t pieceside = WHITE;
-    uint8_t piece = PAWN;
-    uint8_t sidetomove = WHITE;
-    uint64_t square = 0;
-    const char* cursor;
-    for (cursor = fen; *cursor != ' '; cursor++)
+    /* translate the fen to the relative position */
+    uint8_t pieceside = WHITE;
+    uint8_t piece = PAWN;
+    uint8_t sidetomove = WHITE;
+    uint64_t square = 0;
+    const char* cursor;
+    for (cursor = fen; cursor < end && *cursor != ' '; cursor++)
+    {
+        if (*cursor >= '1' && *cursor <= '8') square += *cursor - '0';
+        else if (*cursor == '/') continue;
+        else
+        {
+            uint64_t pos = OppSq(square);
+            if (*cursor == 'p') { piece = PAWN; pieceside = BLACK; }
+            else if (*cursor == 'n') { piece = KNIGHT; pieceside = BLACK; }
+            else if (*cursor == 'b') { piece = BISHOP; pieceside = BLACK; }
+            else if (*cursor == 'r') { piece = ROOK; pieceside = BLACK; }
+            else if (*cursor == 'q') { piece = QUEEN; pieceside = BLACK; }
+            else if (*cursor == 'k') { piece = KING; pieceside = BLACK; }
+            else if (*cursor == 'P') { piece = PAWN; pieceside = WHITE; }
+            else if (*cursor == 'N') { piece = KNIGHT; pieceside = WHITE; }
+            else if (*cursor == 'B') { piece = BISHOP; pieceside = WHITE; }
+            else if (*cursor == 'R') { piece = ROOK; pieceside = WHITE; }
+            else if (*cursor == 'Q') { piece = QUEEN; pieceside = WHITE; }
+            else if (*cursor == 'K') { piece = KING; pieceside = WHITE; }
+            Position->P0 |= ((uint64_t)piece & 1) << pos;
+            Position->P1 |= ((uint64_t)(piece >> 1) & 1) << pos;
+            Position->P2 |= ((uint64_t)piece >> 2) << pos;
+            if (pieceside == WHITE) { Position->PM |= 1ULL << pos; piece |= BLACK; }
+            square++;
+        }
+    }
+    if (end - cursor < 4 || cursor[2] != ' ') /* the side to move and the castle rights can't be missing */
+    {
+        printf("Incomplete fen %.*s\r\n", (int)(end - fen), fen);
+        return 0;
+    }
+    cursor++; /* read the side to move  */
+    if (*cursor == 'w') sidetomove = WHITE;
+    else if (*cursor == 'b') sidetomove = BLACK;
+    cursor += 2;
+    if (*cursor != '-') /* read the castle rights */
+    {
+        for (; cursor < end && *cursor != ' '; cursor++)
+        {
+            if (*cursor == 'K') Position->CastleFlags |= 0x02;
+            else if (*cursor == 'Q') Position->CastleFlags |= 0x01;
+            else if (*cursor == 'k') Position->CastleFlags |= 0x20;
+            else if (*cursor == 'q') Position->CastleFlags |= 0x10;
+        }
+        if (cursor < end) cursor++;
+    }
+    else cursor += end - cursor > 1 ? 2 : 1;
+    if (cursor < end && *cursor != '-') /* read the enpassant column */
+    {
+        Position->EnPassant = *cursor - 'a';
+        //cursor++;
+    }
+    if (sidetomove == BLACK) ChangeSide;
+    return 1;
+}
+
+/*
+Load a position starting from a fen and a list of moves in long algebraic notation separated by spaces.
+Every move is looked up between the legal moves of its position and made with Make.
+It returns 0 if the fen is incomplete or a move is not legal.
+*/
+static int LoadPosition(TSearch* const search, const char* fen, const char* moves)
+{
+    if (!LoadFen(search, fen, fen + strlen(fen))) return 0;
+    while (*moves)
+    {
+        TMove legal[256];
+        char str[6];
+        size_t length = strcspn(moves, " ");
+        TMove* const last = LegalMoves(search, 0, legal);
+        TMove* plegal;
+        for (plegal = legal; plegal < last; plegal++)
+        {
+            MoveToStr(*plegal, search->Position->STM, str);
+            if (length == strlen(str) && !strncmp(moves, str, length)) break;
+        }
+        if (plegal == last)
+        {
+            printf("Illegal move %.*s\r\n", (int)length, moves);
+            return 0;
+        }
+        PROFILE_DEPTH(0); /* the moves of the position aren't in a depth of the Perft */
+        PROFILE_START(making);
+        Make(search, *plegal);
+        PROFILE_STOP(making, PROFILE_MAKE);
+        moves += length;
+        moves += strspn(moves, " ");
+    }
+    return 1;
+}
+
+#endif
+
+static int64_t Perft(TSearch* const search, int depth);
+/* Perft of the legal moves from last - 1 down to first, that are all of the given kind */
+static inline int64_t PerftMoves(TSearch* const search, int depth, const TMove* const first, const TMove* last, TMakeKind kind)
+{
+    int64_t tot = 0;
+    for (; last > first; last--)
+    {
+        const TMove move = *(last - 1);
+        PROFILE_DEPTH(depth);
+        PROFILE_START(checking);
+        const TBB illegal = Illegal(search->Position, move);
+        PROFILE_STOP(checking, PROFILE_ILLEGAL);
+        if (illegal) continue;
+        PROFILE_START(making);
+        MakeKind(search, move, kind);
+        PROFILE_STOP(making, PROFILE_MAKE);
+        tot += Perft(search, depth - 1);
+        Unmake(search, move);
+    }
+    return tot;
+}
+
+/* the same for the captures and promotions list */
+static inline int64_t PerftCaptures(TSearch* const search, int depth, const TMoveEval* const first, const TMoveEval* last, TMakeKind kind)
+{
+    int64_t tot = 0;
+    for (; last > first; last--)
+    {
+        const TMove move = (last - 1)->Move;
+        PROFILE_DEPTH(depth);
+        PROFILE_START(checking);
+        const TBB illegal = Illegal(search->Position, move);
+        PROFILE_STOP(checking, PROFILE_ILLEGAL);
+        if (illegal) continue;
+        PROFILE_START(making);
+        MakeKind(search, move, kind);
+        PROFILE_STOP(making, PROFILE_MAKE);
+        tot += Perft(search, depth - 1);
+        Unmake(search, move);
+    }
+    return tot;
+}
+
+/* Check the correctness of the move generator with the Perft function, the last ply is counted with CountLegal */
+static int64_t Perft(TSearch* const search, int depth)
+{
+    if (depth <= 1)
+    {
+        PROFILE_DEPTH(1);
+        PROFILE_START(counting);
+        const int64_t count = CountLegal(search->Position);
+        PROFILE_STOP(counting, PROFILE_COUNT_LEGAL);
+        return count;
+    }
+
+    TMove* const quiets = search->Quiets[depth];
+    int64_t tot = 0;
+
+    /* the subtrees with depth 1 are faster to count than to look up */
+    TBB key = 0;
+    if (search->Hash)
+    {
+        key = HashKey(search->Position);
+        if (ProbeHash(search->Hash, key, depth, &tot)) return tot;
+    }
+
+    /* the PROFILE macros are empty without INSTRUMENT, the depth is set again after every subtree */
+#if defined(LEGAL_MOVEGEN)
+    PROFILE_DEPTH(depth);
+    PROFILE_START(generating);
+    TMove* const last = GenerateLegal(search->Position, quiets);
+    PROFILE_STOP(generating, PROFILE_GENERATE_LEGAL);
+    for (TMove* pmoves = last; pmoves > quiets; pmoves--)
+    {
+        PROFILE_DEPTH(depth);
+        PROFILE_START(making);
+        Make(search, *(pmoves - 1));
+        PROFILE_STOP(making, PROFILE_MAKE);
+        tot += Perft(search, depth - 1);
+        Unmake(search, *(pmoves - 1));
+    }
+#else
+    /* every group of moves is searched with the make of its kind, from the last generated like before */
+    TMoveEval* const capture = search->Capture[depth];
+    TMoveEval* captureends[3];
+    TMove* quietends[4];
+    PROFILE_DEPTH(depth);
+    PROFILE_START(capturing);
+    GenerateCapture(search->Position, capture, captureends);
+    PROFILE_STOP(capturing, PROFILE_GENERATE_CAPTURE);
+    tot += PerftCaptures(search, depth, captureends[1], captureends[2], MAKE_EP);
+    tot += PerftCaptures(search, depth, captureends[0], captureends[1], MAKE_PROMOTION);
+    tot += PerftCaptures(search, depth, capture, captureends[0], MAKE_CAPTURE);
+    PROFILE_DEPTH(depth);
+    PROFILE_START(generating);
+    GenerateQuiets(search->Position, quiets, quietends);
+    PROFILE_STOP(generating, PROFILE_GENERATE_QUIETS);
+    tot += PerftMoves(search, depth, quietends[2], quietends[3], MAKE_CASTLE);
+    tot += PerftMoves(search, depth, quietends[1], quietends[2], MAKE_DOUBLE_PUSH);
+    tot += PerftMoves(search, depth, quietends[0], quietends[1], MAKE_PUSH);
+    tot += PerftMoves(search, depth, quiets, quietends[0], MAKE_QUIET);
+#endif
+    if (search->Hash) StoreHash(search->Hash, key, depth, tot);
+    return tot;
+}
+
+/*
+Runtime dispatch of the kernel (make qbb_perft_dispatch, gcc or clang on x86-64).
+The file is compiled also for the x86-64-v2, v3 and v4 instruction sets with -DKERNEL_VARIANT=v2 (v3, v4),
+these objects export only a TKernel with their Perft, where the sliders, Illegal, the generators, Make and
+CountLegal are inlined and compiled for that cpu (pext sliders from v3). The main object, compiled with
+-DDISPATCH for the baseline x86-64, chooses at startup the best kernel that the cpu supports, --cpu forces one.
+Without DISPATCH the only kernel is the Perft of this build.
+*/
+#if defined(LEGAL_MOVEGEN)
+#define KERNEL_DESCRIPTION "Legal move generator, " SLIDERS_NAME " sliders" KOGGE_STONE_NAME
+#else
+#define KERNEL_DESCRIPTION "Pseudo-legal move generator, " SLIDERS_NAME " sliders" KOGGE_STONE_NAME
+#endif
+
+typedef struct
+{
+    const char* Name;
+    const char* Description;
+    const char* Sliders;
+    int Level; /* x86-64 microarchitecture level needed by the kernel, 1 for any cpu */
+    void (*Init)(void); /* init the tables of a kernel object, NULL for the kernel of the main object */
+    int64_t (*Perft)(TSearch* const search, int depth);
+} TKernel;
+
+#if defined(KERNEL_VARIANT)
+
+/* a kernel object of the runtime dispatch exports only its TKernel, main is in the main object */
+#define KERNEL_SYMBOL(variant) KERNEL_SYMBOL_(variant)
+#define KERNEL_SYMBOL_(variant) Kernel_##variant
+#define KERNEL_STRING(variant) KERNEL_STRING_(variant)
+#define KERNEL_STRING_(variant) #variant
+
+static void InitKernel(void)
+{
+    InitTables();
+    InitZobrist(); /* the same keys of the main object, the hash tables are shared */
+}
+
+const TKernel KERNEL_SYMBOL(KERNEL_VARIANT) = { "x86-64-" KERNEL_STRING(KERNEL_VARIANT), KERNEL_DESCRIPTION, SLIDERS_NAME,
+    KERNEL_STRING(KERNEL_VARIANT)[1] - '0', InitKernel, Perft };
+
+#else
+
+/* the chosen kernel, its Perft is used at the root of every search */
+static const TKernel* Kernel = NULL;
+static int64_t (*PerftKernel)(TSearch* const search, int depth) = Perft;
+
+/*
+Multithreaded Perft with a work-stealing scheduler.
+Every node above the split ply is a task that pushes the subtrees of its legal moves into the deque of the
+worker that runs it, the nodes at the split ply are counted with the plain Perft.
+A worker takes its own tasks from the bottom of its deque (the last pushed, depth first) and when it has
+nothing left it steals from the top of the other deques, where the oldest and biggest subtrees are.
+*/
+#define MAX_SPLIT_PLY 6
+#define DEQUE_SIZE 2048 /* room for MAX_SPLIT_PLY nested expansions of a node with all its moves */
+
+typedef struct
+{
+    TBoard Board;
+    int Depth; /* remaining depth */
+    int Ply; /* distance from the root */
+    int Root; /* the nodes of the subtree are added to the count with this index */
+    TMove Path[MAX_SPLIT_PLY]; /* the moves from the root, Ply of them */
+} TTask;
+
+typedef struct
+{
+    TMutex Lock;
+    unsigned int Top; /* the thieves take from here */
+    unsigned int Bottom; /* the owner pushes and takes from here */
+    TTask Tasks[DEQUE_SIZE];
+} TDeque;
+
+typedef struct TScheduler TScheduler;
+
+typedef struct
+{
+    TScheduler* Scheduler;
+    int Id;
+    int64_t* Counts; /* nodes counted by this worker for every root task */
+    TDeque Deque;
+    TSearch Search;
+} TWorker;
+
+struct TScheduler
+{
+    TWorker** Workers;
+    int Count;
+    int SplitPly;
+    int Pending; /* tasks pushed and not completed yet */
+};
+
+/*
+Checkpoint of a long search (--checkpoint FILE): the counts of the subtrees at the checkpoint ply are saved with
+the path of moves from the root, and the same search started again with the file skips them. The subtrees at the
+checkpoint ply are searched whole by one thread, so it is also the split ply of the scheduler.
+Every CheckpointInterval seconds the main thread writes all the counts into a temporary file that replaces the
+file, so a crash leaves the previous checkpoint; SIGTERM and SIGINT save a last one and stop the program.
+*/
+#define CHECKPOINT_MAGIC "QBBCKPT"
+#define CHECKPOINT_VERSION 1
+
+typedef struct
+{
+    char Magic[8];
+    uint32_t Version;
+    int32_t Depth; /* depth of the search from the root */
+    int32_t Ply; /* the subtrees are saved at this ply, a record is Ply moves and the count */
+    uint32_t Records;
+    TBB PM, P0, P1, P2; /* the root position */
+    uint8_t CastleFlags, EnPassant, STM, Unused;
+} TCheckpointHeader;
+
+typedef struct
+{
+    TMove Path[MAX_SPLIT_PLY];
+    int64_t Count;
+} TCheckpointRecord;
+
+typedef struct
+{
+    const char* FileName; /* NULL if the search has no checkpoint */
+    TCheckpointHeader Header;
+    TCheckpointRecord* Records; /* the ones read from the file, sorted by path, and then the new ones */
+    uint32_t Loaded;
+    uint32_t Count;
+    uint32_t Capacity;
+    TMutex Lock;
+} TCheckpoint;
+
+static TCheckpoint Checkpoint;
+/* ply of the subtrees saved, set with --checkpoint-ply */
+static int CheckpointPly = 2;
+/* seconds between two checkpoints, set with --checkpoint-interval */
+static int CheckpointInterval = 60;
+/* set by the signal handler, the search is stopped at the next check of the main thread */
+static volatile sig_atomic_t StopRequest = 0;
+
+static void StopHandler(int signum)
+{
+    (void)signum;
+    StopRequest = 1;
+}
+
+/* order of the records by path */
+static int ComparePaths(const void* a, const void* b)
+{
+    const TMove* const pa = ((const TCheckpointRecord*)a)->Path;
+    const TMove* const pb = ((const TCheckpointRecord*)b)->Path;
+    for (int ply = 0; ply < CheckpointPly; ply++)
+        if (pa[ply].Move != pb[ply].Move) return pa[ply].Move < pb[ply].Move ? -1 : 1;
+    return 0;
+}
+
+/*
+Load the checkpoint of the search of the root position at depth, or start an empty one if the file doesn't exist.
+Return 0 if the file is of another search or is damaged: it's not overwritten.
+*/
+static int OpenCheckpoint(const char* filename, const TBoard* const root, int depth)
+{
+    TCheckpointHeader* const header = &Checkpoint.Header;
+    memset(header, 0, sizeof(TCheckpointHeader));
+    memcpy(header->Magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header->Version = CHECKPOINT_VERSION;
+    header->Depth = depth;
+    header->Ply = CheckpointPly;
+    header->PM = root->PM;
+    header->P0 = root->P0;
+    header->P1 = root->P1;
+    header->P2 = root->P2;
+    header->CastleFlags = root->CastleFlags;
+    header->EnPassant = root->EnPassant;
+    header->STM = root->STM;
+    Checkpoint.Records = NULL;
+    Checkpoint.Loaded = Checkpoint.Count = Checkpoint.Capacity = 0;
+
+    FILE* const file = fopen(filename, "rb");
+    if (file)
+    {
+        TCheckpointHeader saved;
+        int ok = fread(&saved, sizeof(saved), 1, file) == 1;
+        const uint32_t records = saved.Records;
+        saved.Records = 0;
+        if (!ok || memcmp(&saved, header, sizeof(saved)))
+        {
+            printf("The checkpoint %s is of another search (or another depth or checkpoint ply)\r\n", filename);
+            fclose(file);
+            return 0;
+        }
+        Checkpoint.Records = malloc((records + 1) * sizeof(TCheckpointRecord));
+        Checkpoint.Capacity = records + 1;
+        for (uint32_t i = 0; ok && i < records; i++)
+        {
+            TCheckpointRecord* const record = &Checkpoint.Records[i];
+            memset(record, 0, sizeof(TCheckpointRecord));
+            ok = fread(record->Path, sizeof(TMove), CheckpointPly, file) == (size_t)CheckpointPly
+                && fread(&record->Count, sizeof(int64_t), 1, file) == 1;
+        }
+        fclose(file);
+        if (!ok)
+        {
+            printf("The checkpoint %s is damaged\r\n", filename);
+            free(Checkpoint.Records);
+            return 0;
+        }
+        qsort(Checkpoint.Records, records, sizeof(TCheckpointRecord), ComparePaths);
+        Checkpoint.Loaded = Checkpoint.Count = records;
+    }
+    Checkpoint.FileName = filename;
+    InitMutex(&Checkpoint.Lock);
+    printf("Checkpoint %s at ply %d, %u subtrees already searched\r\n", filename, CheckpointPly, Checkpoint.Count);
+    signal(SIGTERM, StopHandler);
+    signal(SIGINT, StopHandler);
+    return 1;
+}
+
+/* look for the count of the subtree at the end of the path in the records read from the file, that don't
+   change during the search (the new ones are added after them, and the array is moved only under the lock) */
+static int FindCheckpoint(const TMove* const path, int64_t* const count)
+{
+    TCheckpointRecord key;
+    memcpy(key.Path, path, sizeof(key.Path));
+    LockMutex(&Checkpoint.Lock);
+    const TCheckpointRecord* const record = bsearch(&key, Checkpoint.Records, Checkpoint.Loaded, sizeof(TCheckpointRecord), ComparePaths);
+    if (record) *count = record->Count;
+    UnlockMutex(&Checkpoint.Lock);
+    return record != NULL;
+}
+
+static void AddCheckpoint(const TMove* const path, int64_t count)
+{
+    LockMutex(&Checkpoint.Lock);
+    if (Checkpoint.Count == Checkpoint.Capacity)
+    {
+        Checkpoint.Capacity = Checkpoint.Capacity * 2 + 256;
+        Checkpoint.Records = realloc(Checkpoint.Records, Checkpoint.Capacity * sizeof(TCheckpointRecord));
+    }
+    TCheckpointRecord* const record = &Checkpoint.Records[Checkpoint.Count++];
+    memcpy(record->Path, path, sizeof(record->Path));
+    record->Count = count;
+    UnlockMutex(&Checkpoint.Lock);
+}
+
+/* write the counts into FileName.tmp and rename it to FileName, return 0 if it fails */
+static int SaveCheckpoint(void)
+{
+    char* const temporary = malloc(strlen(Checkpoint.FileName) + 5);
+    strcat(strcpy(temporary, Checkpoint.FileName), ".tmp");
+    LockMutex(&Checkpoint.Lock);
+    FILE* const file = fopen(temporary, "wb");
+    int ok = file != NULL;
+    if (ok)
+    {
+        Checkpoint.Header.Records = Checkpoint.Count;
+        ok = fwrite(&Checkpoint.Header, sizeof(TCheckpointHeader), 1, file) == 1;
+        for (uint32_t i = 0; ok && i < Checkpoint.Count; i++)
+            ok = fwrite(Checkpoint.Records[i].Path, sizeof(TMove), CheckpointPly, file) == (size_t)CheckpointPly
+                && fwrite(&Checkpoint.Records[i].Count, sizeof(int64_t), 1, file) == 1;
+        ok = !fclose(file) && ok;
+        Checkpoint.Header.Records = 0;
+    }
+#if defined(_WIN32)
+    if (ok) remove(Checkpoint.FileName); /* rename doesn't replace a file */
+#endif
+    ok = ok && !rename(temporary, Checkpoint.FileName);
+    UnlockMutex(&Checkpoint.Lock);
+    if (!ok) printf("Cannot write the checkpoint %s\r\n", Checkpoint.FileName);
+    free(temporary);
+    return ok;
+}
+
+/* take the last pushed task, return 0 if the deque is empty */
+static int PopTask(TDeque* const deque, TTask* const task)
+{
+    int found = 0;
+    LockMutex(&deque->Lock);
+    if (deque->Bottom != deque->Top)
+    {
+        *task = deque->Tasks[--deque->Bottom % DEQUE_SIZE];
+        found = 1;
+    }
+    UnlockMutex(&deque->Lock);
+    return found;
+}
+
+/* take the oldest task of another worker, return 0 if the deque is empty */
+static int StealTask(TDeque* const deque, TTask* const task)
+{
+    int found = 0;
+    if (AtomicLoad(&deque->Bottom) == AtomicLoad(&deque->Top)) return 0; /* don't lock an empty deque */
+    LockMutex(&deque->Lock);
+    if (deque->Bottom != deque->Top)
+    {
+        *task = deque->Tasks[deque->Top++ % DEQUE_SIZE];
+        found = 1;
+    }
+    UnlockMutex(&deque->Lock);
+    return found;
+}
+
+/* push a task for every legal move of the task position */
+static void ExpandTask(TWorker* const worker, const TTask* const task)
+{
+    TSearch* const search = &worker->Search;
+    TDeque* const deque = &worker->Deque;
+    TMove moves[256];
+    TTask children[256];
+    const int count = (int)(LegalMoves(search, task->Depth, moves) - moves);
+    for (int i = 0; i < count; i++)
+    {
+        PROFILE_DEPTH(task->Depth);
+        PROFILE_START(making);
+        Make(search, moves[i]);
+        PROFILE_STOP(making, PROFILE_MAKE);
+        children[i].Board = *search->Position;
+        children[i].Depth = task->Depth - 1;
+        children[i].Ply = task->Ply + 1;
+        children[i].Root = task->Root;
+        memcpy(children[i].Path, task->Path, sizeof(task->Path));
+        children[i].Path[task->Ply] = moves[i];
+        Unmake(search, moves[i]);
+    }
+    LockMutex(&deque->Lock);
+    assert(deque->Bottom - deque->Top + count <= DEQUE_SIZE);
+    for (int i = 0; i < count; i++) deque->Tasks[deque->Bottom++ % DEQUE_SIZE] = children[i];
+    AtomicAdd(&worker->Scheduler->Pending, count); /* before the parent task is completed */
+    UnlockMutex(&deque->Lock);
+}
+
+static void RunTask(TWorker* const worker, const TTask* const task)
+{
+    TSearch* const search = &worker->Search;
+    search->Position = search->Game;
+    ResetUndo(search);
+    *search->Position = task->Board;
+    if (task->Ply < worker->Scheduler->SplitPly && task->Depth > 1) ExpandTask(worker, task);
+    else if (Checkpoint.FileName && task->Ply == CheckpointPly)
+    {
+        int64_t count;
+        if (!FindCheckpoint(task->Path, &count))
+        {
+            count = PerftKernel(search, task->Depth);
+            AddCheckpoint(task->Path, count);
+        }
+        worker->Counts[task->Root] += count;
+    }
+    else worker->Counts[task->Root] += PerftKernel(search, task->Depth);
+}
+
+static THREAD_PROC(SchedulerWorker, param)
+{
+    TWorker* const worker = param;
+    TScheduler* const scheduler = worker->Scheduler;
+    TTask task;
+    for (;;)
+    {
+        int found = PopTask(&worker->Deque, &task);
+        for (int i = 1; !found && i < scheduler->Count; i++)
+            found = StealTask(&scheduler->Workers[(worker->Id + i) % scheduler->Count]->Deque, &task);
+        if (found)
+        {
+            RunTask(worker, &task);
+            AtomicAdd(&scheduler->Pending, -1);
+        }
+        else if (AtomicLoad(&scheduler->Pending) == 0) break;
+        else YieldThread();
+    }
+    PROFILE_MERGE();
+    return 0;
+}
+
+/* search the root tasks with the given number of threads, counts[i] receives the nodes of the task i */
+static void RunTasks(const TTask* const tasks, int count, int threads, int64_t* const counts)
+{
+    TScheduler scheduler;
+    scheduler.Workers = malloc(threads * sizeof(TWorker*));
+    scheduler.Count = threads;
+    scheduler.SplitPly = Checkpoint.FileName ? CheckpointPly : SplitPly;
+    scheduler.Pending = count;
+    for (int i = 0; i < threads; i++)
+    {
+        TWorker* const worker = scheduler.Workers[i] = AllocAligned(sizeof(TWorker));
+        worker->Scheduler = &scheduler;
+        worker->Id = i;
+        worker->Counts = calloc(count, sizeof(int64_t));
+        worker->Search.Hash = HashTables ? &HashTables[i % HashTableCount] : NULL;
+        worker->Deque.Top = worker->Deque.Bottom = 0;
+        InitMutex(&worker->Deque.Lock);
+        for (int j = i; j < count; j += threads) /* deal the root tasks to the workers */
+            worker->Deque.Tasks[worker->Deque.Bottom++] = tasks[j];
+    }
+
+    TThread* const threadsid = malloc(threads * sizeof(TThread));
+    for (int i = 0; i < threads; i++) StartThread(&threadsid[i], SchedulerWorker, scheduler.Workers[i]);
+    if (Checkpoint.FileName)
+    {   /* save the checkpoints while the workers search, the last one when they are done */
+        struct timespec last, now;
+        gettime(&last);
+        while (AtomicLoad(&scheduler.Pending) && !StopRequest)
+        {
+            SleepMs(100);
+            gettime(&now);
+            if (ElapsedNs(&last, &now) >= CheckpointInterval * 1000000000LL)
+            {
+                SaveCheckpoint();
+                last = now;
+            }
+        }
+        if (StopRequest)
+        {
+            SaveCheckpoint();
+            printf("Stopped, %u subtrees saved in the checkpoint %s\r\n", Checkpoint.Count, Checkpoint.FileName);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++) JoinThread(threadsid[i]);
+    free(threadsid);
+    if (Checkpoint.FileName) SaveCheckpoint();
+
+    for (int i = 0; i < count; i++) counts[i] = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        for (int j = 0; j < count; j++) counts[j] += scheduler.Workers[i]->Counts[j];
+        free(scheduler.Workers[i]->Counts);
+        DestroyMutex(&scheduler.Workers[i]->Deque.Lock);
+        FreeAligned(scheduler.Workers[i]);
+    }
+    free(scheduler.Workers);
+}
+
+/* Perft of the position of the search context with the given number of threads */
+static int64_t PerftThreads(TSearch* const search, int depth, int threads)
+{
+    if ((threads <= 1 && !Checkpoint.FileName) || depth <= 1) return PerftKernel(search, depth);
+
+    TTask root;
+    int64_t tot;
+    memset(&root, 0, sizeof(TTask));
+    root.Board = *search->Position;
+    root.Depth = depth;
+    root.Ply = 0;
+    root.Root = 0;
+    RunTasks(&root, 1, threads, &tot);
+    return tot;
+}
+
+/*
+Print the count of the subtree of every legal root move and return the total.
+With more threads every root move is a task of the scheduler, so the subtrees are searched in parallel.
+*/
+static int64_t Divide(TSearch* const search, int depth, int threads)
+{
+    TMove moves[256];
+    int64_t counts[256];
+    TTask tasks[256];
+    char str[6];
+    const int scheduled = (threads > 1 || Checkpoint.FileName) && depth > 1;
+    const int count = (int)(LegalMoves(search, depth, moves) - moves);
+    memset(tasks, 0, count * sizeof(TTask));
+    for (int i = 0; i < count; i++)
+    {
+        PROFILE_DEPTH(depth);
+        PROFILE_START(making);
+        Make(search, moves[i]);
+        PROFILE_STOP(making, PROFILE_MAKE);
+        tasks[i].Board = *search->Position;
+        tasks[i].Depth = depth - 1;
+        tasks[i].Ply = 1;
+        tasks[i].Root = i;
+        tasks[i].Path[0] = moves[i];
+        if (!scheduled) counts[i] = depth > 1 ? PerftKernel(search, depth - 1) : 1;
+        Unmake(search, moves[i]);
+    }
+    if (scheduled) RunTasks(tasks, count, threads, counts);
+    else if (depth <= 1) for (int i = 0; i < count; i++) counts[i] = 1;
+
+    int64_t tot = 0;
+    for (int i = 0; i < count; i++)
+    {
+        printf("%s: %" PRId64 "\r\n", MoveToStr(moves[i], search->Position->STM, str), counts[i]);
+        tot += counts[i];
+    }
+    printf("\r\nMoves: %d, Nodes: %" PRId64 "\r\n", count, tot);
+    return tot;
+}
+
+/* the columns of the perft tables, counted on the moves of the last ply */
+typedef struct
+{
+    int64_t Nodes;
+    int64_t Captures;
+    int64_t EnPassant;
+    int64_t Castles;
+    int64_t Promotions;
+    int64_t Checks;
+    int64_t Discovered; /* checks given only by pieces that didn't move */
+    int64_t DoubleChecks;
+    int64_t Checkmates;
+} TPerftStats;
+
+/*
+Perft that classifies the moves of the last ply, a separate function so that Perft pays nothing for it.
+The kind of move is in the MoveType bits and the checks are the Checkers of the position after the move,
+a check is discovered if none of the checkers is a piece that moved (the king and the rook when castling),
+like in the tables of the chess programming wiki, so a double check of the moved piece and a discovered one isn't.
+*/
+static void PerftStats(TSearch* const search, int depth, TPerftStats* const stats)
+{
+    TMove moves[256];
+    TMove* const last = LegalMoves(search, depth, moves);
+    for (TMove* pmoves = moves; pmoves < last; pmoves++)
     {
-        if (*cursor >= '1' && *cursor <= '8') square += *cursor - '0';
-        else if (*cursor == '/') continue;
+        const TBB before = search->Position->PM;
+        PROFILE_DEPTH(depth);
+        PROFILE_START(making);
+        Make(search, *pmoves);
+        PROFILE_STOP(making, PROFILE_MAKE);
+        if (depth > 1) PerftStats(search, depth - 1, stats);
         else
         {
-            uint64_t pos = OppSq(square);
-            if (*cursor == 'p') { piece = PAWN; pieceside = BLACK; }
-            else if (*cursor == 'n') { piece = KNIGHT; pieceside = BLACK; }
-            else if (*cursor == 'b') { piece = BISHOP; pieceside = BLACK; }
-            else if (*cursor == 'r') { piece = ROOK; pieceside = BLACK; }
-            else if (*cursor == 'q') { piece = QUEEN; pieceside = BLACK; }
-            else if (*cursor == 'k') { piece = KING; pieceside = BLACK; }
-            else if (*cursor == 'P') { piece = PAWN; pieceside = WHITE; }
-            else if (*cursor == 'N') { piece = KNIGHT; pieceside = WHITE; }
-            else if (*cursor == 'B') { piece = BISHOP; pieceside = WHITE; }
-            else if (*cursor == 'R') { piece = ROOK; pieceside = WHITE; }
-            else if (*cursor == 'Q') { piece = QUEEN; pieceside = WHITE; }
-            else if (*cursor == 'K') { piece = KING; pieceside = WHITE; }
-            Position->P0 |= ((uint64_t)piece & 1) << pos;
-            Position->P1 |= ((uint64_t)(piece >> 1) & 1) << pos;
-            Position->P2 |= ((uint64_t)piece >> 2) << pos;
-            if (pieceside == WHITE) { Position->PM |= 1ULL << pos; piece |= BLACK; }
-            square++;
+            const TBoard* const Position = search->Position;
+            const TBB checkers = Checkers(Position);
+            const TBB moved = (Position->PM ^ Occupation) & ~RevBB(before);
+            stats->Nodes++;
+            stats->Captures += (pmoves->MoveType & CAPTURE) != 0;
+            stats->EnPassant += (pmoves->MoveType & EP) != 0;
+            stats->Castles += (pmoves->MoveType & CASTLE) != 0;
+            stats->Promotions += (pmoves->MoveType & PROMO) != 0;
+            stats->Checks += checkers != 0;
+            stats->Discovered += checkers && !(checkers & moved);
+            stats->DoubleChecks += PopCount(checkers) > 1;
+            stats->Checkmates += checkers && !CountLegal(Position);
         }
+        Unmake(search, *pmoves);
     }
-    cursor++; /* read the side to move  */
-    if (*cursor == 'w') sidetomove = WHITE;
-    else if (*cursor == 'b') sidetomove = BLACK;
-    cursor += 2;
-    if (*cursor != '-') /* read the castle rights */
+}
+
+/* print the table of the statistics of every depth up to the given one */
+static void PrintPerftStats(TSearch* const search, int maxdepth)
+{
+    printf("Depth         Nodes     Captures      E.p.   Castles  Promotions       Checks  Discovered  Double checks  Checkmates\r\n");
+    for (int depth = 1; depth <= maxdepth; depth++)
+    {
+        TPerftStats stats = { 0 };
+        PerftStats(search, depth, &stats);
+        printf("%5d %13" PRId64 " %12" PRId64 " %9" PRId64 " %9" PRId64 " %11" PRId64 " %12" PRId64 " %11" PRId64 " %14" PRId64 " %11" PRId64 "\r\n",
+            depth, stats.Nodes, stats.Captures, stats.EnPassant, stats.Castles, stats.Promotions, stats.Checks,
+            stats.Discovered, stats.DoubleChecks, stats.Checkmates);
+    }
+}
+
+/* the 6 test positions with their depth and expected count */
+static const struct
+{
+    char fen[200];
+    int depth;
+    int64_t count;
+}Test[] = { {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",6,119060324},
+          {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",5,193690690},
+          {"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 7,178633661},
+          {"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",6,706045033},
+          {"rnbqkb1r/pp1p1ppp/2p5/4P3/2B5/8/PPP1NnPP/RNBQK2R w KQkq - 0 6",3,53392},
+          {"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",5,164075551} };
+
+/*
+Compare the shared hash table with a table for every thread (same total size) on the test positions,
+with 1, 8 and 32 threads. Every run starts with empty tables.
+*/
+static void BenchHash(uint64_t mb)
+{
+    static const int threads[] = { 1, 8, 32 };
+    static TSearch search;
+    printf("Hash %" PRIu64 " MB\r\n", mb);
+    printf("%8s %12s %12s %10s %10s\r\n", "Threads", "Table", "Nodes", "ms", "KNPS");
+    for (unsigned int t = 0; t < (sizeof threads) / (sizeof(threads[0])); t++)
     {
-        for (; *cursor != ' '; cursor++)
+        for (int shared = 1; shared >= 0; shared--)
         {
-            if (*cursor == 'K') Position->CastleFlags |= 0x02;
-            else if (*cursor == 'Q') Position->CastleFlags |= 0x01;
-            else if (*cursor == 'k') Position->CastleFlags |= 0x20;
-            else if (*cursor == 'q') Position->CastleFlags |= 0x10;
+            if (!InitHashTables(mb, threads[t], shared))
+            {
+                printf("Cannot allocate %" PRIu64 " MB of hash\r\n", mb);
+                return;
+            }
+            search.Hash = &HashTables[0];
+            int64_t totalCount = 0;
+            struct timespec begin, end;
+            gettime(&begin);
+            for (unsigned int i = 0; i < (sizeof Test) / (sizeof(Test[0])); i++)
+            {
+                LoadPosition(&search, Test[i].fen, "");
+                int64_t count = PerftThreads(&search, Test[i].depth, threads[t]);
+                if (count != Test[i].count)
+                    printf("Error in position %u: expected %" PRId64 " computed %" PRId64 "\r\n", i + 1, Test[i].count, count);
+                totalCount += count;
+            }
+            gettime(&end);
+            long t_diff = (end.tv_sec - begin.tv_sec) * 1000 + (end.tv_nsec - begin.tv_nsec) / (1000 * 1000);
+            if (t_diff < 1) t_diff = 1;
+            printf("%8d %12s %12" PRId64 " %10ld %10ld\r\n", threads[t], shared ? "shared" : "per-thread", totalCount, t_diff, (long)(totalCount / t_diff));
         }
-        cursor++;
     }
-    else cursor += 2;
-    if (*cursor != '-') /* read the enpassant column */
+    FreeHashTables();
+}
+
+/* read the count of the field ;Dn of the record for the depth, return -1 if it's missing */
+static int64_t EPDCount(const char* record, const char* const end, int depth)
+{
+    for (; record < end; record++)
     {
-        Position->EnPassant = *cursor - 'a';
-        //cursor++;
+        if (*record != ';') continue;
+        const char* cursor = record + 1;
+        while (cursor < end && *cursor == ' ') cursor++;
+        if (cursor >= end || *cursor++ != 'D') continue;
+        int fielddepth = 0;
+        for (; cursor < end && *cursor >= '0' && *cursor <= '9'; cursor++) fielddepth = fielddepth * 10 + *cursor - '0';
+        if (fielddepth != depth) continue;
+        while (cursor < end && *cursor == ' ') cursor++;
+        int64_t count = 0;
+        if (cursor >= end || *cursor < '0' || *cursor > '9') return -1;
+        for (; cursor < end && *cursor >= '0' && *cursor <= '9'; cursor++) count = count * 10 + *cursor - '0';
+        return count;
     }
-    if (sidetomove == BLACK) ChangeSide;
+    return -1;
 }
 
-/* Check the correctness of the move generator with the Perft function */
-static int64_t Perft(int depth)
+/* a record of an EPD suite: the fen and the fields are read in the mapped file */
+typedef struct
+{
+    const char* Fen;
+    const char* Fields; /* the first ';' */
+    const char* End; /* the end of the line */
+    int FenLength;
+    int Deepest; /* the deepest depth verified */
+    int64_t Estimate; /* expected count at the deepest depth, the longest positions are searched first */
+    int64_t Counts[MAX_DEPTH];
+    int64_t Ns;
+    volatile int32_t Done;
+} TEPDRecord;
+
+/* the positions of a suite are shared by a pool of threads, each searching a whole position */
+typedef struct
 {
-    TMove quiets[256];
-    TMoveEval capture[64];
-    TMove move;
-    move.Move = 0;
+    TEPDRecord* Records;
+    int* Order; /* indexes of the records by decreasing estimate */
+    int Count;
+    int MaxDepth;
+    volatile int32_t Next; /* next in Order to search */
+    int Printed; /* the records are printed in the order of the file */
+    int Failed;
+    int64_t TotalCount;
+    TMutex Lock;
+} TSuite;
 
-    int64_t tot = 0;
+typedef struct
+{
+    TSuite* Suite;
+    TSearch Search;
+} TSuiteWorker;
+
+/* sort by decreasing estimate, the input order for the same estimate */
+static const TEPDRecord* SortRecords;
+static int CompareEstimate(const void* a, const void* b)
+{
+    const int i = *(const int*)a, j = *(const int*)b;
+    if (SortRecords[i].Estimate != SortRecords[j].Estimate) return SortRecords[i].Estimate < SortRecords[j].Estimate ? 1 : -1;
+    return i - j;
+}
+
+/* print the result of a record, with a line for every wrong count, and return 1 if it failed */
+static int PrintRecord(const TEPDRecord* const record, int index, int maxdepth)
+{
+    int wrong = 0;
+    for (int depth = 1; depth <= maxdepth; depth++)
+    {
+        const int64_t expected = EPDCount(record->Fields, record->End, depth);
+        if (expected < 0 || expected == record->Counts[depth]) continue;
+        printf("%d %.*s D%d expected %" PRId64 " computed %" PRId64 "\r\n", index + 1, record->FenLength, record->Fen,
+            depth, expected, record->Counts[depth]);
+        wrong = 1;
+    }
+    int64_t searched = 0; /* the nodes of all the depths, Ns is their time */
+    for (int depth = 1; depth <= record->Deepest; depth++) searched += record->Counts[depth];
+    printf("%d %.*s D%d %" PRId64 " %s, %.3f ms, %.0fK NPS\r\n", index + 1, record->FenLength, record->Fen, record->Deepest,
+        record->Counts[record->Deepest], wrong ? "FAILED" : "ok", record->Ns / 1e6, record->Ns ? searched * 1e6 / record->Ns : 0.0);
+    return wrong;
+}
 
-    for (TMoveEval* pcapture = GenerateCapture(capture); pcapture > capture; pcapture--)
+static THREAD_PROC(SuiteWorker, param)
+{
+    TSuiteWorker* const worker = param;
+    TSuite* const suite = worker->Suite;
+    TSearch* const search = &worker->Search;
+    for (int next; (next = AtomicAdd(&suite->Next, 1)) < suite->Count;)
     {
-        move = (pcapture - 1)->Move;
-        if (Illegal(move)) continue;
-        if (depth > 1)
+        TEPDRecord* const record = &suite->Records[suite->Order[next]];
+        for (int depth = 1; depth <= record->Deepest; depth++)
+        {
+            if (EPDCount(record->Fields, record->End, depth) < 0) continue;
+            if (!LoadFen(search, record->Fen, record->Fen + record->FenLength)) break;
+            struct timespec begin, finish;
+            gettime(&begin);
+            record->Counts[depth] = PerftKernel(search, depth);
+            gettime(&finish);
+            record->Ns += ElapsedNs(&begin, &finish);
+        }
+
+        /* print the records finished since the last one printed */
+        LockMutex(&suite->Lock);
+        record->Done = 1;
+        for (; suite->Printed < suite->Count && suite->Records[suite->Printed].Done; suite->Printed++)
         {
-            Make(move);
-            tot += Perft(depth - 1);
-            Position--;
+            const TEPDRecord* const done = &suite->Records[suite->Printed];
+            for (int depth = 1; depth <= done->Deepest; depth++) suite->TotalCount += done->Counts[depth];
+            suite->Failed += PrintRecord(done, suite->Printed, suite->MaxDepth);
         }
-        else tot++;
+        fflush(stdout);
+        UnlockMutex(&suite->Lock);
+    }
+    PROFILE_MERGE();
+    return 0;
+}
+
+/*
+Run the positions of an EPD perft suite, with records like "fen ;D1 20 ;D2 400 ;D3 8902".
+The file is mapped in memory and every record is parsed where it is: the fen is loaded directly from the
+mapping and the counts of the ;Dn fields up to maxdepth are verified.
+The positions are searched by a pool of threads, one position for each thread, taking first the positions
+with the largest expected count so that a long one doesn't start last; the results are printed in the order of the file.
+Return the number of positions with a wrong count.
+*/
+static int RunEPD(const char* filename, int maxdepth, int threads)
+{
+    size_t size = 0;
+    const char* const data = MapFile(filename, &size);
+    if (!data)
+    {
+        printf("Cannot read %s\r\n", filename);
+        return -1;
     }
-    for (TMove* pquiets = GenerateQuiets(quiets); pquiets > quiets; pquiets--)
+
+    TSuite suite;
+    int capacity = 1024;
+    suite.Records = malloc(capacity * sizeof(TEPDRecord));
+    suite.Count = 0;
+    for (const char* line = data; line < data + size;)
     {
-        move = *(pquiets - 1);
-        if (Illegal(move)) continue;
-        if (depth > 1)
+        const char* end = memchr(line, '\n', data + size - line);
+        if (!end) end = data + size;
+        const char* const fields = memchr(line, ';', end - line);
+        if (fields && *line != '#')
         {
-            Make(move);
-            tot += Perft(depth - 1);
-            Position--;
+            if (suite.Count == capacity) suite.Records = realloc(suite.Records, (capacity *= 2) * sizeof(TEPDRecord));
+            TEPDRecord* const record = &suite.Records[suite.Count++];
+            memset(record, 0, sizeof(TEPDRecord));
+            record->Fen = line;
+            record->Fields = fields;
+            record->End = end;
+            record->FenLength = (int)(fields - line);
+            while (record->FenLength && (line[record->FenLength - 1] == ' ' || line[record->FenLength - 1] == '\t')) record->FenLength--;
+            for (int depth = 1; depth <= maxdepth; depth++)
+            {
+                const int64_t expected = EPDCount(fields, end, depth);
+                if (expected < 0) continue;
+                record->Deepest = depth;
+                record->Estimate = expected;
+            }
         }
-        else tot++;
+        line = end + 1;
     }
-    return tot;
+
+    suite.Order = malloc((suite.Count + 1) * sizeof(int));
+    for (int i = 0; i < suite.Count; i++) suite.Order[i] = i;
+    SortRecords = suite.Records;
+    qsort(suite.Order, suite.Count, sizeof(int), CompareEstimate);
+    suite.MaxDepth = maxdepth;
+    suite.Next = 0;
+    suite.Printed = 0;
+    suite.Failed = 0;
+    suite.TotalCount = 0;
+    InitMutex(&suite.Lock);
+
+    if (threads < 1) threads = 1;
+    TSuiteWorker* const workers = AllocAligned(threads * sizeof(TSuiteWorker));
+    TThread* const threadsid = malloc(threads * sizeof(TThread));
+    struct timespec begin, finish;
+    gettime(&begin);
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].Suite = &suite;
+        workers[i].Search.Hash = HashTables ? &HashTables[i % HashTableCount] : NULL;
+        if (threads > 1) StartThread(&threadsid[i], SuiteWorker, &workers[i]);
+    }
+    if (threads > 1)
+        for (int i = 0; i < threads; i++) JoinThread(threadsid[i]);
+    else SuiteWorker(&workers[0]);
+    gettime(&finish);
+    const int64_t ns = ElapsedNs(&begin, &finish);
+
+    printf("\r\nPositions: %d, failed: %d, %" PRId64 " Nodes, %.0f ms, %.0fK NPS\r\n", suite.Count, suite.Failed,
+        suite.TotalCount, ns / 1e6, ns ? suite.TotalCount * 1e6 / ns : 0.0);
+    free(threadsid);
+    FreeAligned(workers);
+    DestroyMutex(&suite.Lock);
+    free(suite.Order);
+    free(suite.Records);
+    UnmapFile(data, size);
+    return suite.Failed;
 }
 
-/* Run the Perft with this 6 test positions */
-static void TestPerft(void)
+/*
+Hardware counters of the benchmark, read with perf_event_open around every search. Every counter is opened
+by itself and inherited by the threads of the scheduler, a counter that can't be opened (not linux, a container
+or perf_event_paranoid) is missing and its columns are printed as "-".
+*/
+#define COUNTERS 5
+enum { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_BRANCH_MISSES, COUNTER_L1D_MISSES, COUNTER_LLC_MISSES };
+static const char* const CounterName[COUNTERS] = { "cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses" };
+
+typedef struct
 {
-    struct {
-        char fen[200];
-        int depth;
-        int64_t count;
-    }Test[] = { {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",6,119060324},
-              {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",5,193690690},
-              {"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 7,178633661},
-              {"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",6,706045033},
-              {"rnbqkb1r/pp1p1ppp/2p5/4P3/2B5/8/PPP1NnPP/RNBQK2R w KQkq - 0 6",3,53392},
-              {"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",5,164075551} };
+    int Fd[COUNTERS]; /* -1 if missing */
+} TCounters;
+
+#if defined(__linux__)
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+static int OpenCounters(TCounters* const counters)
+{
+    static const uint32_t type[COUNTERS] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE };
+    static const uint64_t config[COUNTERS] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) };
+    int opened = 0;
+    for (int i = 0; i < COUNTERS; i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type[i];
+        attr.config = config[i];
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters->Fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        opened += counters->Fd[i] >= 0;
+    }
+    return opened;
+}
+
+static void StartCounters(const TCounters* const counters)
+{
+    for (int i = 0; i < COUNTERS; i++)
+    {
+        if (counters->Fd[i] < 0) continue;
+        ioctl(counters->Fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->Fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/* add the counts since StartCounters to values, scaled if the counters were multiplexed */
+static void StopCounters(const TCounters* const counters, double* const values)
+{
+    for (int i = 0; i < COUNTERS; i++)
+    {
+        uint64_t data[3]; /* value, time enabled, time running */
+        if (counters->Fd[i] < 0) continue;
+        ioctl(counters->Fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counters->Fd[i], data, sizeof(data)) == sizeof(data) && data[2])
+            values[i] += (double)data[0] * data[1] / data[2];
+    }
+}
+
+static void CloseCounters(TCounters* const counters)
+{
+    for (int i = 0; i < COUNTERS; i++)
+        if (counters->Fd[i] >= 0) close(counters->Fd[i]);
+}
+
+#else
+
+static int OpenCounters(TCounters* const counters)
+{
+    for (int i = 0; i < COUNTERS; i++) counters->Fd[i] = -1;
+    return 0;
+}
+
+static void StartCounters(const TCounters* const counters) { (void)counters; }
+static void StopCounters(const TCounters* const counters, double* const values) { (void)counters; (void)values; }
+static void CloseCounters(TCounters* const counters) { (void)counters; }
+
+#endif
+
+/* print a/b in a column, or "-" if one of the counters is missing */
+static void PrintRatio(double a, double b, int width, int precision)
+{
+    if (a < 0 || b <= 0) printf(" %*s", width, "-");
+    else printf(" %*.*f", width, precision, a / b);
+}
+
+static void WriteRatio(FILE* const file, const char* name, double a, double b)
+{
+    if (a < 0 || b <= 0) fprintf(file, ", \"%s\": null", name);
+    else fprintf(file, ", \"%s\": %.4f", name, a / b);
+}
+
+/* the times of the repetitions of a benchmark, in nanoseconds */
+typedef struct
+{
+    int64_t Min;
+    int64_t Median;
+    double Mean;
+    double Stddev;
+} TTimes;
+
+static int CompareInt64(const void* a, const void* b)
+{
+    const int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* sort the samples and compute their statistics */
+static void TimesOf(int64_t* const samples, int count, TTimes* const times)
+{
+    qsort(samples, count, sizeof(int64_t), CompareInt64);
+    times->Min = samples[0];
+    times->Median = count & 1 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+    times->Mean = 0;
+    for (int i = 0; i < count; i++) times->Mean += samples[i];
+    times->Mean /= count;
+    times->Stddev = 0;
+    for (int i = 0; i < count; i++) times->Stddev += (samples[i] - times->Mean) * (samples[i] - times->Mean);
+    times->Stddev = count > 1 ? sqrt(times->Stddev / (count - 1)) : 0;
+}
+
+/*
+Benchmark the test positions: every position is searched warmup times without measuring and then
+repetitions times, the hash tables are cleared before every search.
+Print min, median, mean and standard deviation of the times in nanoseconds and write them with the
+description of the build and of the host in the json file, if given ("-" for the standard output).
+Return the number of wrong counts.
+*/
+/* the standard output of the json with --json -, where printf doesn't write (the tables go to the standard error) */
+static FILE* JsonStdout = NULL;
+
+static int Bench(int repetitions, int warmup, const char* json, int usecounters)
+{
+    static TSearch search;
+    const int positions = (sizeof Test) / (sizeof(Test[0]));
+    TTimes times[(sizeof Test) / (sizeof(Test[0]))];
+    double values[(sizeof Test) / (sizeof(Test[0]))][COUNTERS]; /* average of the repetitions, -1 if missing */
+    TCounters counters;
+    for (int c = 0; c < COUNTERS; c++) counters.Fd[c] = -1;
+    if (usecounters && !OpenCounters(&counters)) printf("The hardware counters are not available\r\n");
+    int64_t* const samples = malloc(repetitions * sizeof(int64_t));
+    int64_t totalCount = 0, totalMedian = 0;
+    int errors = 0;
+    search.Hash = HashTables ? &HashTables[0] : NULL;
+    printf("Warmup %d, repetitions %d, threads %d\r\n", warmup, repetitions, Threads);
+    printf("%3s %5s %12s %14s %14s %14s %12s %10s", "Pos", "Depth", "Nodes", "Min ns", "Median ns", "Mean ns", "Stddev ns", "KNPS");
+    if (usecounters) printf(" %6s %10s %12s %10s %10s", "IPC", "Cycles/N", "BrMisses/N", "L1DMiss/N", "LLCMiss/N");
+    printf("\r\n");
+    for (int i = 0; i < positions; i++)
+    {
+        for (int c = 0; c < COUNTERS; c++) values[i][c] = counters.Fd[c] >= 0 ? 0 : -1;
+        for (int r = -warmup; r < repetitions; r++)
+        {
+            if (HashTables) ClearHashTables(Threads);
+            LoadPosition(&search, Test[i].fen, "");
+            struct timespec begin, end;
+            if (r >= 0) StartCounters(&counters);
+            gettime(&begin);
+            const int64_t count = PerftThreads(&search, Test[i].depth, Threads);
+            gettime(&end);
+            if (r >= 0)
+            {
+                StopCounters(&counters, values[i]);
+                samples[r] = ElapsedNs(&begin, &end);
+            }
+            if (count != Test[i].count)
+            {
+                printf("Error in position %d: expected %" PRId64 " computed %" PRId64 "\r\n", i + 1, Test[i].count, count);
+                errors++;
+            }
+        }
+        TimesOf(samples, repetitions, &times[i]);
+        totalCount += Test[i].count;
+        totalMedian += times[i].Median;
+        for (int c = 0; c < COUNTERS; c++) if (values[i][c] > 0) values[i][c] /= repetitions;
+        printf("%3d %5d %12" PRId64 " %14" PRId64 " %14" PRId64 " %14.0f %12.0f %10.0f", i + 1, Test[i].depth, Test[i].count,
+            times[i].Min, times[i].Median, times[i].Mean, times[i].Stddev, Test[i].count * 1e6 / times[i].Median);
+        if (usecounters)
+        {
+            PrintRatio(values[i][COUNTER_INSTRUCTIONS], values[i][COUNTER_CYCLES], 6, 2);
+            PrintRatio(values[i][COUNTER_CYCLES], (double)Test[i].count, 10, 1);
+            PrintRatio(values[i][COUNTER_BRANCH_MISSES], (double)Test[i].count, 12, 3);
+            PrintRatio(values[i][COUNTER_L1D_MISSES], (double)Test[i].count, 10, 3);
+            PrintRatio(values[i][COUNTER_LLC_MISSES], (double)Test[i].count, 10, 4);
+        }
+        printf("\r\n");
+    }
+    CloseCounters(&counters);
+    printf("\r\nTotal: %" PRId64 " Nodes, %.3f ms median, %.0fK NPS\r\n", totalCount, totalMedian / 1e6, totalCount * 1e6 / totalMedian);
+    free(samples);
+
+    if (!json) return errors;
+    FILE* const file = strcmp(json, "-") ? fopen(json, "w") : JsonStdout;
+    if (!file)
+    {
+        printf("Cannot write %s\r\n", json);
+        return errors + 1;
+    }
+    fprintf(file, "{\n  \"version\": \"1.1\",\n");
+#if defined(LEGAL_MOVEGEN)
+    fprintf(file, "  \"generator\": \"legal\",\n");
+#else
+    fprintf(file, "  \"generator\": \"pseudo-legal\",\n");
+#endif
+    fprintf(file, "  \"kernel\": \"%s\",\n  \"sliders\": \"%s\",\n  \"kogge_stone\": %s,\n", Kernel->Name, Kernel->Sliders,
+        KOGGE_STONE_NAME[0] ? "true" : "false");
+#if defined(__GNUC__) && !defined(__clang__)
+    fprintf(file, "  \"compiler\": \"gcc %s\",\n", __VERSION__);
+#elif defined(__VERSION__)
+    fprintf(file, "  \"compiler\": \"%s\",\n", __VERSION__);
+#elif defined(_MSC_FULL_VER)
+    fprintf(file, "  \"compiler\": \"msvc %d\",\n", _MSC_FULL_VER);
+#endif
+    fprintf(file, "  \"host\": \"%s\",\n  \"threads\": %d,\n  \"split_ply\": %d,\n", HostName(), Threads, SplitPly);
+    fprintf(file, "  \"hash_mb\": %" PRIu64 ",\n  \"hash_tables\": %d,\n  \"hash_backing\": \"%s\",\n",
+        HashMB(), HashTableCount, HashTables ? HashTables[0].Backing : "none");
+    fprintf(file, "  \"warmup\": %d,\n  \"repetitions\": %d,\n  \"positions\": [\n", warmup, repetitions);
+    for (int i = 0; i < positions; i++)
+    {
+        fprintf(file, "    { \"fen\": \"%s\", \"depth\": %d, \"nodes\": %" PRId64 ", \"min_ns\": %" PRId64 ", \"median_ns\": %" PRId64
+            ", \"mean_ns\": %.0f, \"stddev_ns\": %.0f, \"nps\": %.0f", Test[i].fen, Test[i].depth, Test[i].count,
+            times[i].Min, times[i].Median, times[i].Mean, times[i].Stddev, Test[i].count * 1e9 / times[i].Median);
+        if (usecounters)
+        {
+            for (int c = 0; c < COUNTERS; c++)
+            {
+                if (values[i][c] < 0) fprintf(file, ", \"%s\": null", CounterName[c]);
+                else fprintf(file, ", \"%s\": %.0f", CounterName[c], values[i][c]);
+            }
+            WriteRatio(file, "ipc", values[i][COUNTER_INSTRUCTIONS], values[i][COUNTER_CYCLES]);
+            WriteRatio(file, "cycles_per_node", values[i][COUNTER_CYCLES], (double)Test[i].count);
+            WriteRatio(file, "branch_misses_per_node", values[i][COUNTER_BRANCH_MISSES], (double)Test[i].count);
+        }
+        fprintf(file, " }%s\n", i + 1 < positions ? "," : "");
+    }
+    fprintf(file, "  ],\n  \"total\": { \"nodes\": %" PRId64 ", \"median_ns\": %" PRId64 ", \"nps\": %.0f }\n}\n",
+        totalCount, totalMedian, totalCount * 1e9 / totalMedian);
+    if (file != JsonStdout) fclose(file);
+    else fflush(file);
+    return errors;
+}
+
+#if defined(INSTRUMENT)
+/* print the cycles and the calls of the instrumented functions, in total and for every depth, at the exit */
+static void PrintProfile(void)
+{
+    static const char* const name[PROFILE_FUNCTIONS] = { "GenerateCapture", "GenerateQuiets", "GenerateLegal", "Illegal", "Make",
+        "ChangeSide", "CountLegal" };
+    uint64_t cycles[PROFILE_FUNCTIONS] = { 0 }, calls[PROFILE_FUNCTIONS] = { 0 }, total = 0;
+    MergeProfile(); /* the counters of the main thread */
+    for (int f = 0; f < PROFILE_FUNCTIONS; f++)
+    {
+        for (int d = 0; d < MAX_DEPTH; d++)
+        {
+            cycles[f] += ProfileTotal.Cycles[f][d];
+            calls[f] += ProfileTotal.Calls[f][d];
+        }
+        if (f != PROFILE_CHANGE_SIDE) total += cycles[f]; /* already counted in Make */
+    }
+    if (!total) return;
+    printf("\r\n%-16s %14s %16s %12s %8s\r\n", "Function", "Calls", "Cycles", "Cycles/call", "%");
+    for (int f = 0; f < PROFILE_FUNCTIONS; f++)
+    {
+        if (!calls[f]) continue;
+        printf("%-16s %14" PRIu64 " %16" PRIu64 " %12.1f %7.1f%%\r\n", name[f], calls[f], cycles[f],
+            (double)cycles[f] / calls[f], 100.0 * cycles[f] / total);
+    }
+    printf("\r\nMcycles by depth (depth 1 are the leaves counted by CountLegal)\r\n%5s", "Depth");
+    for (int f = 0; f < PROFILE_FUNCTIONS; f++) if (calls[f]) printf(" %16s", name[f]);
+    printf("\r\n");
+    for (int d = 1; d < MAX_DEPTH; d++)
+    {
+        int used = 0;
+        for (int f = 0; f < PROFILE_FUNCTIONS; f++) used |= ProfileTotal.Calls[f][d] != 0;
+        if (!used) continue;
+        printf("%5d", d);
+        for (int f = 0; f < PROFILE_FUNCTIONS; f++) if (calls[f]) printf(" %16.1f", ProfileTotal.Cycles[f][d] / 1e6);
+        printf("\r\n");
+    }
+}
+#endif
 
+/* Run the Perft with this 6 test positions, at most at maxdepth (the expected counts are only of the full depths) */
+static void TestPerft(int maxdepth)
+{
+    static TSearch search;
+    search.Hash = HashTables ? &HashTables[0] : NULL;
     int64_t totalCount = 0;
     int64_t totalDuration = 0;
     for (unsigned int i = 0; i < (sizeof Test) / (sizeof(Test[0])); i++)
     {
-        LoadPosition(Test[i].fen, "");
+        const int depth = Test[i].depth < maxdepth ? Test[i].depth : maxdepth;
+        LoadPosition(&search, Test[i].fen, "");
         struct timespec begin, end;
         gettime(&begin);
-        printf("%s%"PRId64"%s%"PRId64"%s", "Expected: ", Test[i].count, " Computed: ", Perft(Test[i].depth), "\r\n");
+        const int64_t count = PerftThreads(&search, depth, Threads);
         gettime(&end);
+        if (depth == Test[i].depth) printf("%s%"PRId64"%s%"PRId64"%s", "Expected: ", Test[i].count, " Computed: ", count, "\r\n");
+        else printf("Depth %d Computed: %"PRId64"\r\n", depth, count);
         long t_diff = (end.tv_sec - begin.tv_sec) * 1000 + (end.tv_nsec - begin.tv_nsec) / (1000 * 1000);
-        long knps = Test[i].count / t_diff;
+        if (t_diff < 1) t_diff = 1; /* the shortest positions run in less than a millisecond */
+        long knps = count / t_diff;
         printf("%lu ms, %luK NPS\r\n", t_diff, knps);
-        totalCount += Test[i].count;
+        totalCount += count;
         totalDuration += t_diff;
     }
     printf("\r\n");
@@ -836,9 +3481,210 @@ static void TestPerft(void)
     exit(0);
 }
 
+
+/* the kernels from the best, the first that the cpu supports is chosen */
+#if defined(DISPATCH)
+extern const TKernel Kernel_v2, Kernel_v3, Kernel_v4;
+static const TKernel KernelBase = { "x86-64", KERNEL_DESCRIPTION, SLIDERS_NAME, 1, NULL, Perft };
+static const TKernel* const Kernels[] = { &Kernel_v4, &Kernel_v3, &Kernel_v2, &KernelBase };
+#else
+static const TKernel KernelBuild = { "default", KERNEL_DESCRIPTION, SLIDERS_NAME, 1, NULL, Perft };
+static const TKernel* const Kernels[] = { &KernelBuild };
+#endif
+
+/* the x86-64 microarchitecture level of the cpu, checked on the features that the kernels use */
+static int CpuLevel(void)
+{
+#if defined(DISPATCH)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq") &&
+        __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) return 4;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2") &&
+        __builtin_cpu_supports("fma")) return 3;
+    if (__builtin_cpu_supports("popcnt") && __builtin_cpu_supports("sse4.2")) return 2;
+#endif
+    return 1;
+}
+
+/* choose the kernel, the given one if name is not NULL, and init it. Return NULL if it's unknown or not supported */
+static const TKernel* ChooseKernel(const char* name)
+{
+    const int level = CpuLevel();
+    for (unsigned int i = 0; i < (sizeof Kernels) / (sizeof(Kernels[0])); i++)
+    {
+        if (name && strcmp(name, Kernels[i]->Name)) continue;
+        if (Kernels[i]->Level > level)
+        {
+            if (!name) continue;
+            printf("The cpu doesn't support the %s kernel\r\n", name);
+            return NULL;
+        }
+        if (Kernels[i]->Init) Kernels[i]->Init();
+        PerftKernel = Kernels[i]->Perft;
+        return Kernel = Kernels[i];
+    }
+    if (name) printf("Unknown kernel %s, the kernels are listed by --cpu list\r\n", name);
+    return NULL;
+}
+
+static void ListKernels(void)
+{
+    const int level = CpuLevel();
+    for (unsigned int i = 0; i < (sizeof Kernels) / (sizeof(Kernels[0])); i++)
+        printf("%-10s %-55s %s\r\n", Kernels[i]->Name, Kernels[i]->Description, Kernels[i]->Level <= level ? "supported" : "not supported");
+}
+
 int main(int argc, char* argv[])
 {
+    uint64_t hashmb = 0;
+    int sharedhash = 1, benchhash = 0, divide = 0, depth = 0, testdepth = MAX_DEPTH - 1, stats = 0, bench = 0, warmup = 1, counters = 0;
+    const char* fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+    const char* epd = NULL;
+    const char* json = NULL;
+    const char* cpu = NULL;
+    const char* hashfile = NULL;
+    const char* checkpoint = NULL;
+    char* moves = calloc(1, 1);
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc) Threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc) SplitPly = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--hash") && i + 1 < argc) hashmb = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--hash-per-thread")) sharedhash = 0;
+        else if (!strcmp(argv[i], "--hash-file") && i + 1 < argc) hashfile = argv[++i];
+        else if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc) checkpoint = argv[++i];
+        else if (!strcmp(argv[i], "--checkpoint-ply") && i + 1 < argc) CheckpointPly = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--checkpoint-interval") && i + 1 < argc) CheckpointInterval = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--bench-hash")) benchhash = 1;
+        else if (!strcmp(argv[i], "--divide") && i + 1 < argc) divide = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--depth") && i + 1 < argc) depth = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--test-depth") && i + 1 < argc) testdepth = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--stats") && i + 1 < argc) stats = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--bench") && i + 1 < argc) bench = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--warmup") && i + 1 < argc) warmup = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--json") && i + 1 < argc) json = argv[++i];
+        else if (!strcmp(argv[i], "--counters")) counters = 1;
+        else if (!strcmp(argv[i], "--cpu") && i + 1 < argc) cpu = argv[++i];
+        else if (!strcmp(argv[i], "--fen") && i + 1 < argc) fen = argv[++i];
+        else if (!strcmp(argv[i], "--epd") && i + 1 < argc) epd = argv[++i];
+        else if (!strcmp(argv[i], "--moves"))
+        {   /* all the following arguments up to the next option */
+            for (; i + 1 < argc && argv[i + 1][0] != '-'; i++)
+            {
+                moves = realloc(moves, strlen(moves) + strlen(argv[i + 1]) + 2);
+                strcat(strcat(moves, argv[i + 1]), " ");
+            }
+        }
+        else
+        {
+            printf("Unknown option %s\r\n", argv[i]);
+            return 1;
+        }
+    }
+    if (bench && json && !strcmp(json, "-")) JsonStdout = SeparateStdout(); /* only the json on the standard output */
     printf("QBB Perft in C - v1.1\r\n");
-    TestPerft();
+    if (depth < 0 || depth >= MAX_DEPTH || divide < 0 || divide >= MAX_DEPTH || stats < 0 || stats >= MAX_DEPTH || testdepth < 1 || testdepth >= MAX_DEPTH)
+    {
+        printf("The depth must be between 1 and %d\r\n", MAX_DEPTH - 1);
+        return 1;
+    }
+    if (SplitPly < 1 || SplitPly > MAX_SPLIT_PLY)
+    {
+        printf("The split ply must be between 1 and %d\r\n", MAX_SPLIT_PLY);
+        return 1;
+    }
+    if (checkpoint && (CheckpointPly < 1 || CheckpointPly > MAX_SPLIT_PLY || CheckpointPly >= (divide ? divide : depth)))
+    {
+        printf("The checkpoint needs --depth or --divide and a checkpoint ply between 1 and %d, lower than the depth\r\n", MAX_SPLIT_PLY);
+        return 1;
+    }
+    if (bench < 0 || warmup < 0)
+    {
+        printf("The repetitions and the warmup can't be negative\r\n");
+        return 1;
+    }
+    if (hashfile && (bench || benchhash))
+    {   /* the benchmarks start every search from empty tables, they would clear the counts of the file */
+        printf("The hash file can't be used with --bench or --bench-hash\r\n");
+        return 1;
+    }
+    if (Threads < 1) Threads = 1;
+    if (cpu && !strcmp(cpu, "list"))
+    {
+        ListKernels();
+        return 0;
+    }
+    if (!ChooseKernel(cpu)) return 1;
+#if defined(DISPATCH)
+    printf("%s, %s kernel\r\n", Kernel->Description, Kernel->Name);
+#else
+    printf("%s\r\n", Kernel->Description);
+#endif
+#if defined(INSTRUMENT)
+    atexit(PrintProfile);
+#endif
+    InitTables();
+    InitZobrist();
+    if (benchhash)
+    {
+        BenchHash(hashmb ? hashmb : 256);
+        return 0;
+    }
+    if (hashfile && !sharedhash)
+    {
+        printf("The hash file is a shared table, it can't be used with --hash-per-thread\r\n");
+        return 1;
+    }
+    if (hashfile)
+    {
+        if (!OpenHashFile(hashfile, hashmb))
+        {
+            printf("Cannot map the hash file %s\r\n", hashfile);
+            return 1;
+        }
+        printf("Hash %" PRIu64 " MB in %s, %s\r\n", HashMB(), hashfile, HashTables[0].Backing);
+    }
+    else if (hashmb)
+    {
+        struct timespec begin, end;
+        gettime(&begin);
+        if (!InitHashTables(hashmb, Threads, sharedhash))
+        {
+            printf("Cannot allocate %" PRIu64 " MB of hash\r\n", hashmb);
+            return 1;
+        }
+        gettime(&end);
+        printf("Hash %" PRIu64 " MB in %d table%s, %s, faulted in %" PRId64 " ms\r\n", HashMB(), HashTableCount,
+            HashTableCount > 1 ? "s" : "", HashTables[0].Backing, ElapsedNs(&begin, &end) / 1000000);
+    }
+    if (bench)
+        return Bench(bench, warmup, json, counters) ? 1 : 0;
+    if (epd) /* the depth limits the ;Dn fields verified */
+        return RunEPD(epd, depth ? depth : MAX_DEPTH - 1, Threads) ? 1 : 0;
+    if (stats)
+    {   /* the perft tables of the position of the command line */
+        static TSearch search;
+        if (!LoadPosition(&search, fen, moves)) return 1;
+        PrintPerftStats(&search, stats);
+        return 0;
+    }
+    if (depth || divide)
+    {   /* search the position of the command line */
+        static TSearch search;
+        search.Hash = HashTables ? &HashTables[0] : NULL;
+        if (!LoadPosition(&search, fen, moves)) return 1;
+        if (checkpoint && !OpenCheckpoint(checkpoint, search.Position, divide ? divide : depth)) return 1;
+        struct timespec begin, end;
+        gettime(&begin);
+        int64_t count = divide ? Divide(&search, divide, Threads) : PerftThreads(&search, depth, Threads);
+        gettime(&end);
+        long t_diff = (end.tv_sec - begin.tv_sec) * 1000 + (end.tv_nsec - begin.tv_nsec) / (1000 * 1000);
+        if (t_diff < 1) t_diff = 1;
+        printf("Nodes: %" PRId64 ", %ld ms, %ldK NPS\r\n", count, t_diff, (long)(count / t_diff));
+        return 0;
+    }
+    TestPerft(testdepth);
     return 0;
 }
+
+#endif